@@ -0,0 +1,560 @@
+#ifndef ASYNC_IO_HEADER
+#define ASYNC_IO_HEADER
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include "StreamHash.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define BMP_HAVE_IO_URING 1
+#endif
+
+// Whole-file reads and writes that run in the background.
+// Files are moved in AsyncIO::chunk_size pieces with many pieces in flight at once:
+// through io_uring when the kernel supports its read and write operations (Linux 5.6+),
+// otherwise on std::async threads. The ring is driven by its own thread, so files
+// larger than the queue keep moving while the caller is busy with something else.
+// Files are known by their absolute path: a relative path means the file in the
+// directory that was current at the call.
+// With hash_reads() on, every read is also hashed (StreamHash) chunk by chunk
+// as the data arrives, so the hash costs no extra pass over the file.
+// An AsyncIO object is meant to be driven from a single thread.
+class AsyncIO {
+public:
+    static constexpr size_t chunk_size = 1 << 20;
+
+    explicit AsyncIO(unsigned queue_depth = 64) {
+#ifdef BMP_HAVE_IO_URING
+        ring.setup(queue_depth);
+#else
+        (void) queue_depth;
+#endif
+    }
+
+    ~AsyncIO() {
+        try {
+            flush();
+        }
+        catch (...) {
+        }
+    }
+
+    AsyncIO(const AsyncIO&) = delete;
+    AsyncIO& operator=(const AsyncIO&) = delete;
+
+    bool uses_io_uring() const {
+#ifdef BMP_HAVE_IO_URING
+        return ring.fd >= 0;
+#else
+        return false;
+#endif
+    }
+
+    void hash_reads(bool enable) {
+        hashing = enable;
+    }
+
+    // Starts reading `path` so a later read(path) only waits for what is still in flight
+    void prefetch(const std::string &path) {
+        std::string key = absolute_path(path);
+        if (reads.count(key)) {
+            return;
+        }
+        wait_writes_to(key);
+
+        std::shared_ptr<Request> req = std::make_shared<Request>();
+        req->path = key;
+        req->hashing = hashing;
+#ifdef BMP_HAVE_IO_URING
+        if (uses_io_uring()) {
+            ring.start_read(req);
+            reads[key] = req;
+            return;
+        }
+#endif
+        req->pending = std::async(std::launch::async, read_file, req);
+        reads[key] = req;
+    }
+
+    // Returns the whole file; `hash` receives its StreamHash digest
+    std::vector<uint8_t> read(const std::string &path, uint64_t *hash = nullptr) {
+        prefetch(path);
+        std::string key = absolute_path(path);
+        std::shared_ptr<Request> req = reads[key];
+        reads.erase(key);
+        wait(*req);
+
+        if (req->error) {
+            throw std::runtime_error("Unable to read \"" + path + "\": " + std::strerror(req->error));
+        }
+        if (hash) {
+            if (!req->hashing) {
+                req->hash.update(req->buffer.data(), req->buffer.size());
+            }
+            *hash = req->hash.digest();
+        }
+        return std::move(req->buffer);
+    }
+
+    // Queues `bytes` to be written to `path`. A file that cannot be created throws
+    // right away; errors while writing are reported by take_failed_writes() and flush()
+    void write_behind(const std::string &path, std::vector<uint8_t> bytes) {
+        std::string key = absolute_path(path);
+        wait_writes_to(key);
+        reads.erase(key);
+
+        std::shared_ptr<Request> req = std::make_shared<Request>();
+        req->path = key;
+        req->fd = ::open(key.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (req->fd < 0) {
+            throw std::runtime_error("Unable to write \"" + path + "\": " + std::strerror(errno));
+        }
+        req->buffer = std::move(bytes);
+        writes.push_back(req);
+#ifdef BMP_HAVE_IO_URING
+        if (uses_io_uring()) {
+            ring.start(req, true);
+            return;
+        }
+#endif
+        req->pending = std::async(std::launch::async, write_file, req);
+    }
+
+    // Paths of the finished writes that failed since the last call (or flush())
+    std::vector<std::string> take_failed_writes() {
+        collect_writes();
+        std::vector<std::string> failed;
+        failed.swap(failed_writes);
+        return failed;
+    }
+
+    // Waits for every queued write and throws if any of them failed
+    void flush() {
+        for (std::shared_ptr<Request> &req : writes) {
+            wait(*req);
+        }
+        collect_writes();
+
+        if (!failed_writes.empty()) {
+            std::string msg = "Unable to write";
+            for (const std::string &path : failed_writes) {
+                msg += " \"" + path + "\"";
+            }
+            failed_writes.clear();
+            throw std::runtime_error(msg);
+        }
+    }
+
+    size_t writes_in_flight() const {
+        return writes.size();
+    }
+
+private:
+    struct Request {
+        std::string                     path;
+        int                             fd{-1};
+        std::vector<uint8_t>            buffer;
+        size_t                          chunks_left{0};
+        int                             error{0};
+        bool                            hashing{false};
+        StreamHash                      hash;
+        size_t                          hashed{0};      // Length of the prefix already fed to `hash`
+        std::vector<char>               chunk_done;
+        std::future<void>               pending;        // thread fallback only
+        std::atomic<bool>               done{false};    // Set last: the fields above are final once it is true
+    };
+
+    bool                                            hashing{false};
+    std::map<std::string, std::shared_ptr<Request>> reads;
+    std::list<std::shared_ptr<Request>>             writes;
+    std::vector<std::string>                        failed_writes;
+
+    static int fd_error(int fd) {
+        return fd < 0 ? errno : 0;
+    }
+
+    static std::string absolute_path(const std::string &path) {
+        return boost::filesystem::absolute(path).lexically_normal().string();
+    }
+
+    static void read_file(std::shared_ptr<Request> req) {
+        int fd = ::open(req->path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            req->error = errno;
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            req->buffer.resize(st.st_size);
+        }
+
+        size_t done = 0;
+        while (done < req->buffer.size()) {
+            ssize_t res = ::pread(fd, req->buffer.data() + done, std::min(chunk_size, req->buffer.size() - done), done);
+            if (res <= 0) {
+                req->error = res < 0 ? errno : EIO;
+                break;
+            }
+            if (req->hashing) {
+                req->hash.update(req->buffer.data() + done, res);
+            }
+            done += res;
+        }
+        ::close(fd);
+    }
+
+    // `req->fd` is opened by write_behind()
+    static void write_file(std::shared_ptr<Request> req) {
+        int fd = req->fd;
+        size_t done = 0;
+        while (done < req->buffer.size()) {
+            ssize_t res = ::pwrite(fd, req->buffer.data() + done, std::min(chunk_size, req->buffer.size() - done), done);
+            if (res < 0) {
+                req->error = errno;
+                break;
+            }
+            done += res;
+        }
+        ::close(fd);
+    }
+
+    void wait(Request &req) {
+        if (req.pending.valid()) {
+            req.pending.get();
+            req.done = true;
+        }
+#ifdef BMP_HAVE_IO_URING
+        if (!req.done) {
+            ring.wait(req);
+        }
+#endif
+    }
+
+    void wait_writes_to(const std::string &path) {
+        for (std::shared_ptr<Request> &req : writes) {
+            if (req->path == path) {
+                wait(*req);
+            }
+        }
+        collect_writes();
+    }
+
+    void collect_writes() {
+        for (auto it = writes.begin(); it != writes.end();) {
+            Request &req = **it;
+            if (req.pending.valid() &&
+                    req.pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                wait(req);
+            }
+            if (req.done) {
+                if (req.error) {
+                    failed_writes.push_back(req.path);
+                }
+                it = writes.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+#ifdef BMP_HAVE_IO_URING
+    // Minimal io_uring driver on top of the raw syscalls (no liburing dependency).
+    // Callers queue chunks with start(); the reaper thread waits for completions,
+    // hashes reads and refills the queue from the backlog. The mutex guards the
+    // rings, the backlog and the requests until they are done.
+    struct Ring {
+        struct Chunk {
+            std::shared_ptr<Request> req;
+            bool                     is_write;
+            size_t                   index;
+            size_t                   offset;
+            size_t                   len;
+        };
+
+        int             fd{-1};
+        uint8_t         *sq_ptr{nullptr};
+        uint8_t         *cq_ptr{nullptr};
+        io_uring_sqe    *sqes{nullptr};
+        size_t          sq_size{0}, cq_size{0}, sqes_size{0};
+        unsigned        *sq_tail, *sq_mask, *sq_array;
+        unsigned        *cq_head, *cq_tail, *cq_mask;
+        io_uring_cqe    *cqes;
+        unsigned        sq_entries{0};
+        unsigned        in_flight{0};
+        std::deque<Chunk*> backlog;
+
+        std::mutex              mutex;
+        std::condition_variable changed;        // New chunks for the reaper, finished requests for wait()
+        std::thread             reaper;
+        bool                    stopping{false};
+        std::string             failure;        // Why the reaper stopped early
+
+        void setup(unsigned entries) {
+            io_uring_params p;
+            std::memset(&p, 0, sizeof(p));
+            int ring_fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+            if (ring_fd < 0) {
+                return;
+            }
+            if (!supports(ring_fd, IORING_OP_READ) || !supports(ring_fd, IORING_OP_WRITE)) {
+                ::close(ring_fd);
+                return;
+            }
+
+            sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) {
+                sq_size = cq_size = std::max(sq_size, cq_size);
+            }
+
+            void *sq = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+            void *cq = single_mmap ? sq :
+                        mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+            void *sqe = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+            if (sq == MAP_FAILED || cq == MAP_FAILED || sqe == MAP_FAILED) {
+                ::close(ring_fd);
+                return;
+            }
+
+            fd = ring_fd;
+            sq_ptr = (uint8_t*) sq;
+            cq_ptr = (uint8_t*) cq;
+            sqes = (io_uring_sqe*) sqe;
+            sq_tail = (unsigned*) (sq_ptr + p.sq_off.tail);
+            sq_mask = (unsigned*) (sq_ptr + p.sq_off.ring_mask);
+            sq_array = (unsigned*) (sq_ptr + p.sq_off.array);
+            cq_head = (unsigned*) (cq_ptr + p.cq_off.head);
+            cq_tail = (unsigned*) (cq_ptr + p.cq_off.tail);
+            cq_mask = (unsigned*) (cq_ptr + p.cq_off.ring_mask);
+            cqes = (io_uring_cqe*) (cq_ptr + p.cq_off.cqes);
+            sq_entries = p.sq_entries;
+            reaper = std::thread(&Ring::run, this);
+        }
+
+        // Rings of Linux 5.1-5.5 set up fine but have no IORING_OP_READ/WRITE, nor the probe to ask for them
+        static bool supports(int ring_fd, uint8_t op) {
+            std::vector<uint8_t> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+            io_uring_probe *probe = (io_uring_probe*) buf.data();
+            if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+                return false;
+            }
+            return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        }
+
+        ~Ring() {
+            if (fd < 0) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            reaper.join();      // After the chunks in flight, unless it failed: those are leaked with
+                                // their buffers, closing the ring cancels them
+            munmap(sqes, sqes_size);
+            if (cq_ptr != sq_ptr) {
+                munmap(cq_ptr, cq_size);
+            }
+            munmap(sq_ptr, sq_size);
+            ::close(fd);
+        }
+
+        void start_read(const std::shared_ptr<Request> &req) {
+            req->fd = ::open(req->path.c_str(), O_RDONLY);
+            req->error = fd_error(req->fd);
+
+            struct stat st;
+            if (!req->error && fstat(req->fd, &st) == 0) {
+                req->buffer.resize(st.st_size);
+            }
+            start(req, false);
+        }
+
+        void start(const std::shared_ptr<Request> &req, bool is_write) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!req->error) {
+                for (size_t offset = 0; offset < req->buffer.size(); offset += chunk_size) {
+                    size_t len = std::min(chunk_size, req->buffer.size() - offset);
+                    backlog.push_back(new Chunk{ req, is_write, offset / chunk_size, offset, len });
+                    ++req->chunks_left;
+                }
+                req->chunk_done.assign(req->chunks_left, 0);
+            }
+            if (!req->chunks_left) {
+                finish(*req);
+            }
+            submit();
+            changed.notify_all();
+        }
+
+        void wait(Request &req) {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return req.done || !failure.empty(); });
+            if (!req.done) {
+                throw std::runtime_error(failure);
+            }
+        }
+
+        void run() {
+            std::unique_lock<std::mutex> lock(mutex);
+            try {
+                for (;;) {
+                    changed.wait(lock, [&] { return in_flight || stopping; });
+                    if (!in_flight) {
+                        return;
+                    }
+                    if (!ready()) {
+                        lock.unlock();
+                        enter(0, 1, IORING_ENTER_GETEVENTS);
+                        lock.lock();
+                    }
+                    reap();
+                    changed.notify_all();
+                }
+            }
+            catch (const std::exception &e) {
+                if (!lock.owns_lock()) {
+                    lock.lock();
+                }
+                failure = e.what();
+                changed.notify_all();
+            }
+        }
+
+        void finish(Request &req) {
+            if (req.fd >= 0) {
+                ::close(req.fd);
+                req.fd = -1;
+            }
+            req.done = true;
+        }
+
+        // Moves as much of the backlog as fits into the submission queue
+        void submit() {
+            unsigned queued = 0;
+            unsigned tail = *sq_tail;
+            while (!backlog.empty() && in_flight < sq_entries) {
+                Chunk *chunk = backlog.front();
+                backlog.pop_front();
+
+                unsigned index = tail & *sq_mask;
+                io_uring_sqe *sqe = &sqes[index];
+                std::memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = chunk->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe->fd = chunk->req->fd;
+                sqe->addr = (uint64_t) (chunk->req->buffer.data() + chunk->offset);
+                sqe->len = (uint32_t) chunk->len;
+                sqe->off = chunk->offset;
+                sqe->user_data = (uint64_t) chunk;
+                sq_array[index] = index;
+
+                ++tail;
+                ++queued;
+                ++in_flight;
+            }
+            if (queued) {
+                __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+                enter(queued, 0, 0);
+            }
+        }
+
+        // Handles the completed chunks
+        void reap() {
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                io_uring_cqe *cqe = &cqes[head & *cq_mask];
+                Chunk *chunk = (Chunk*) cqe->user_data;
+                Request &req = *chunk->req;
+                --in_flight;
+
+                if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+                    req.error = -cqe->res;
+                } else if (cqe->res == 0 && chunk->len) {
+                    req.error = EIO;
+                } else if (cqe->res < (int) chunk->len) {
+                    // Short transfer: queue the rest of the chunk again
+                    size_t moved = cqe->res > 0 ? cqe->res : 0;
+                    chunk->offset += moved;
+                    chunk->len -= moved;
+                    backlog.push_front(chunk);
+                    continue;
+                }
+
+                if (req.hashing && !chunk->is_write) {
+                    hash_ready_prefix(req, chunk->index);
+                }
+                delete chunk;
+                if (--req.chunks_left == 0) {
+                    finish(req);
+                }
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            submit();
+        }
+
+        // Chunks complete in any order; the hash takes them in file order
+        static void hash_ready_prefix(Request &req, size_t index) {
+            req.chunk_done[index] = 1;
+            while (req.hashed < req.buffer.size() && req.chunk_done[req.hashed / chunk_size]) {
+                size_t len = std::min(chunk_size, req.buffer.size() - req.hashed);
+                req.hash.update(req.buffer.data() + req.hashed, len);
+                req.hashed += len;
+            }
+        }
+
+        bool ready() const {
+            return *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+        void enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+            for (;;) {
+                long res = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+                if (res < 0) {
+                    if (errno == EINTR || errno == EAGAIN) {
+                        continue;
+                    }
+                    throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+                }
+                if ((unsigned) res >= to_submit) {
+                    return;
+                }
+                to_submit -= res;
+            }
+        }
+    };
+
+    Ring ring;
+#endif
+};
+
+#endif // ASYNC_IO_HEADER
@@ -6,8 +6,16 @@
 #include <string>
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <stdexcept>
+#include <thread>
+#include "ColorSpace.h"
+#include "Composite.h"
+#include "ImageView.h"
+#include "Parallel.h"
+#include "VignetteMask.h"
 
 #pragma pack(push, 1)
 
@@ -44,11 +52,52 @@ struct BMPColorHeader {
 
 #pragma pack(pop)
 
+enum BMPCompression : uint32_t {
+    BI_RGB          = 0,
+    BI_RLE8         = 1,
+    BI_RLE4         = 2,
+    BI_BITFIELDS    = 3
+};
+
+// What BMP::probe() learns from the headers alone
+struct BMPInfo {
+    int32_t     width{0};
+    int32_t     height{0};
+    uint16_t    bit_count{0};
+    uint32_t    compression{0};
+    uint32_t    colors_used{0};
+    bool        top_down{false};
+};
+
+// Read-only std::streambuf over a byte buffer, so an image that is already
+// in memory can be parsed by the same code that reads files.
+struct MemoryStreamBuf : std::streambuf {
+    MemoryStreamBuf(const uint8_t *bytes, size_t size) {
+        char *begin = (char*) bytes;
+        setg(begin, begin, begin + size);
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        char *base = dir == std::ios_base::beg ? eback() : (dir == std::ios_base::cur ? gptr() : egptr());
+        if (!(which & std::ios_base::in) || base + off < eback() || base + off > egptr()) {
+            return pos_type(off_type(-1));
+        }
+        setg(eback(), base + off, egptr());
+        return pos_type(gptr() - eback());
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+};
+
 struct BMP {
     BMPFileHeader           file_header;
     BMPInfoHeader           bmp_info_header;
     BMPColorHeader          bmp_color_header;
+    std::vector<uint32_t>   palette;        // BGRX quads of 8-bit images
     std::vector<uint8_t>    data;
+    bool                    top_down{false};
 
     BMP() = default;
 
@@ -59,56 +108,56 @@ struct BMP {
     void read(const char *fname) {
         std::ifstream inp{ fname, std::ios_base::binary };
         if (inp) {
-            inp.read((char*) &file_header, sizeof(file_header));
-            if (file_header.file_type != 0x4D42) {
-                throw std::runtime_error("Error! Unrecognized file format.");
-            }
-
-            inp.read((char*) &bmp_info_header, sizeof(bmp_info_header));
-
-            if (bmp_info_header.bit_count == 32) {
-                if (bmp_info_header.size >= (sizeof(BMPInfoHeader) + sizeof(BMPColorHeader))) {
-                    inp.read((char*) &bmp_color_header, sizeof(bmp_color_header));
-                    check_color_header(bmp_color_header);
-                } else {
-                    std::cerr << "Error! The file \"" << fname << "\" does not seem to contain bit mask information\n";
-                    throw std::runtime_error("Error! Unrecognized file format.");
-                }
-            }
-
-            inp.seekg(file_header.offset_data, inp.beg);
-
-            if (bmp_info_header.bit_count == 32) {
-                bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
-                file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
-            } else {
-                bmp_info_header.size = sizeof(BMPInfoHeader);
-                file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
-            }
-            file_header.file_size = file_header.offset_data;
+            read_headers(inp, fname);
+            read_pixels(inp, 0, 0, bmp_info_header.width, bmp_info_header.height);
+        } else {
+            throw std::runtime_error("Unable to open the input image file.");
+        }
+    }
 
-            if (bmp_info_header.height < 0) {
-                throw std::runtime_error("The program can treat only BMP images with the origin in the bottom left corner!");
-            }
+    // Reads BMPFileHeader and BMPInfoHeader only, through an unbuffered stream,
+    // so neither the palette nor any pixel data is touched
+    static BMPInfo probe(const char *fname) {
+        std::ifstream inp;
+        inp.rdbuf()->pubsetbuf(nullptr, 0);
+        inp.open(fname, std::ios_base::binary);
+        if (!inp) {
+            throw std::runtime_error("Unable to open the input image file.");
+        }
 
-            data.resize(bmp_info_header.width * bmp_info_header.height * bmp_info_header.bit_count / 8);
+        BMPFileHeader probe_file_header;
+        BMPInfoHeader probe_info_header;
+        inp.read((char*) &probe_file_header, sizeof(probe_file_header));
+        inp.read((char*) &probe_info_header, sizeof(probe_info_header));
+        if (!inp || probe_file_header.file_type != 0x4D42) {
+            throw std::runtime_error("Error! Unrecognized file format.");
+        }
 
-            if (bmp_info_header.width % 4 == 0) {
-                inp.read((char*) data.data(), data.size());
-                file_header.file_size += static_cast<uint32_t> (data.size());
-            } else {
-                row_stride = bmp_info_header.width * bmp_info_header.bit_count / 8;
-                uint32_t new_stride = make_stride_aligned(4);
-                std::vector<uint8_t> padding_row(new_stride - row_stride);
+        BMPInfo info;
+        info.width = probe_info_header.width;
+        info.height = std::abs(probe_info_header.height);
+        info.bit_count = probe_info_header.bit_count;
+        info.compression = probe_info_header.compression;
+        info.colors_used = probe_info_header.colors_used;
+        info.top_down = probe_info_header.height < 0;
+        return info;
+    }
 
-                for (int y = 0; y < bmp_info_header.height; ++y) {
-                    inp.read((char*) (data.data() + row_stride * y), row_stride);
-                    inp.read((char*) padding_row.data(), padding_row.size());
-                }
+    // Parses a whole .bmp file that is already in memory (see AsyncIO)
+    void load(const std::vector<uint8_t> &file_bytes) {
+        MemoryStreamBuf buf(file_bytes.data(), file_bytes.size());
+        std::istream inp(&buf);
+        read_headers(inp, "<memory>");
+        read_pixels(inp, 0, 0, bmp_info_header.width, bmp_info_header.height);
+    }
 
-                file_header.file_size += static_cast<uint32_t> (data.size()) +
-                            bmp_info_header.height * static_cast<uint32_t> (padding_row.size());
-            }
+    // Loads only the (x0, y0, w, h) rectangle: rows outside it are never read
+    // and each row read starts at column x0, so the cost follows the tile size.
+    void read(const char *fname, uint32_t x0, uint32_t y0, uint32_t w, uint32_t h) {
+        std::ifstream inp{ fname, std::ios_base::binary };
+        if (inp) {
+            read_headers(inp, fname);
+            read_pixels(inp, x0, y0, w, h);
         } else {
             throw std::runtime_error("Unable to open the input image file.");
         }
@@ -127,85 +176,186 @@ struct BMP {
             file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
 
             bmp_info_header.bit_count = 32;
-            bmp_info_header.compression = 3;
+            bmp_info_header.compression = BI_BITFIELDS;
+            pixel_format = PixelFormat::BGRA32;
             row_stride = width * 4;
-            data.resize(row_stride * height);
-            file_header.file_size = file_header.offset_data + data.size();
         } else {
             bmp_info_header.size = sizeof(BMPInfoHeader);
             file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
 
             bmp_info_header.bit_count = 24;
-            bmp_info_header.compression = 0;
+            bmp_info_header.compression = BI_RGB;
+            pixel_format = PixelFormat::BGR24;
             row_stride = width * 3;
-            data.resize(row_stride * height);
-
-            uint32_t new_stride = make_stride_aligned(4);
-            file_header.file_size = file_header.offset_data +
-                        static_cast<uint32_t> (data.size()) + bmp_info_header.height * (new_stride - row_stride);
         }
+        data.resize(row_stride * height);
+        update_file_size();
     }
 
     void write(const char *fname) {
         std::ofstream of{fname, std::ios_base::binary};
 
         if (of) {
-            if (bmp_info_header.bit_count == 32) {
-                write_headers_and_data(of);
-            } else if (bmp_info_header.bit_count == 24) {
-                if (bmp_info_header.width % 4 == 0) {
-                    write_headers_and_data(of);
-                } else {
-                    uint32_t new_stride = make_stride_aligned(4);
-                    std::vector<uint8_t> padding_row(new_stride - row_stride);
+            std::vector<uint8_t> file_bytes;
+            encode(file_bytes);
+            of.write((const char*) file_bytes.data(), file_bytes.size());
+        } else {
+            throw std::runtime_error("Unable to open the output image file.");
+        }
+    }
 
-                    write_headers(of);
+    // Serializes headers and padded rows into one buffer, so the file goes out in a single write.
+    // 8-bit images are stored with their palette (BI_RLE8 / BI_RLE4 if `compression` asks for it),
+    // top-down images keep their row order and a negative height.
+    void encode(std::vector<uint8_t> &file_bytes) {
+        if (bmp_info_header.bit_count != 32 && bmp_info_header.bit_count != 24 && bmp_info_header.bit_count != 8) {
+            throw std::runtime_error("The program can treat only 8, 24 or 32 bits per pixel BMP files");
+        }
 
-                    for (int y = 0; y < bmp_info_header.height; ++y) {
-                        of.write((const char*) (data.data() + row_stride * y), row_stride);
-                        of.write((const char*) padding_row.data(), padding_row.size());
-                    }
-                }
-            } else {
-                throw std::runtime_error("The program can treat only 24 or 32 bits per pixel BMP files");
-            }
+        update_layout();
+        if (bmp_info_header.bit_count != 8) {
+            bmp_info_header.compression = bmp_info_header.bit_count == 32 ? BI_BITFIELDS : BI_RGB;
+        } else if (bmp_info_header.compression == BI_RLE4 && !fits_rle4()) {
+            bmp_info_header.compression = BI_RLE8;
+        }
+
+        std::vector<uint8_t> rle;
+        BMPInfoHeader info_header = bmp_info_header;
+        if (bmp_info_header.compression == BI_RLE8 || bmp_info_header.compression == BI_RLE4) {
+            encode_rle(rle, bmp_info_header.compression == BI_RLE4);
+            bmp_info_header.size_image = (uint32_t) rle.size();
+            file_header.file_size = file_header.offset_data + bmp_info_header.size_image;
+
+            info_header = bmp_info_header;
+            info_header.bit_count = bmp_info_header.compression == BI_RLE4 ? 4 : 8;
+        } else if (top_down) {
+            info_header.height = -info_header.height;
+        }
+
+        file_bytes.assign(file_header.file_size, 0);
+        uint8_t *out = file_bytes.data();
+        out = append_bytes(out, &file_header, sizeof(file_header));
+        out = append_bytes(out, &info_header, sizeof(info_header));
+        if (bmp_info_header.bit_count == 32) {
+            out = append_bytes(out, &bmp_color_header, sizeof(bmp_color_header));
+        }
+        if (!palette.empty()) {     // 24 and 32-bit images have none: memcpy from its null data() is undefined
+            out = append_bytes(out, palette.data(), palette.size() * sizeof(uint32_t));
+        }
+
+        if (!rle.empty()) {
+            std::memcpy(out, rle.data(), rle.size());
+            return;
+        }
+
+        uint32_t new_stride = make_stride_aligned(4);
+        if (new_stride == row_stride) {
+            std::memcpy(out, data.data(), data.size());
         } else {
-            throw std::runtime_error("Unable to open the output image file.");
+            for (int y = 0; y < bmp_info_header.height; ++y) {
+                std::memcpy(out + (size_t) new_stride * y, data.data() + (size_t) row_stride * y, row_stride);
+            }
         }
     }
 
+    PixelFormat format() const {
+        return pixel_format;
+    }
+
+    // `data` keeps the rows in file order; for top-down images the view
+    // starts at the last stored row and walks back with a negative stride.
+    ImageView view() {
+        ImageView img{ data.data(), (uint32_t) bmp_info_header.width, (uint32_t) bmp_info_header.height,
+                            (ptrdiff_t) row_stride, format() };
+        if (top_down && img.height > 0) {
+            img.ptr += img.stride * (ptrdiff_t) (img.height - 1);
+            img.stride = -img.stride;
+        }
+        return img;
+    }
+
+    ImageView view(uint32_t x0, uint32_t y0, uint32_t w, uint32_t h) {
+        return view().crop(x0, y0, w, h);
+    }
+
     void fill_region(uint32_t x0, uint32_t y0, uint32_t w, uint32_t h, uint8_t B, uint8_t G, uint8_t R, uint8_t A = 1) {
-        if (x0 + w > (uint32_t) bmp_info_header.width || y0 + h > (uint32_t) bmp_info_header.height) {
+        if (!region_fits(x0, y0, w, h, bmp_info_header.width, bmp_info_header.height)) {
             throw std::runtime_error("The region does not fit in the image!");
         }
 
-        uint32_t channels = bmp_info_header.bit_count / 8;
-        for (uint32_t y = y0; y < y0 + h; ++y) {
-            for (uint32_t x = x0; x < x0 + w; ++x) {
-                data[channels * (y * bmp_info_header.width + x) + 0] = B;
-                data[channels * (y * bmp_info_header.width + x) + 1] = G;
-                data[channels * (y * bmp_info_header.width + x) + 2] = R;
-
-                if (channels == 4) {
-                    data[channels * (y * bmp_info_header.width + x) + 3] = A;
-                }
+        fit_color(R, G, B);
+        ImageView region = view(x0, y0, w, h);
+        uint32_t channels = region.channels();
+        for (uint32_t y = 0; y < h; ++y) {
+            uint8_t *pix = region.row(y);
+            for (uint32_t x = 0; x < w; ++x, pix += channels) {
+                set_pixel(pix, channels, R, G, B, A);
             }
         }
     }
 
+    // Turns palette indices into pixel values: Gray8 when every palette entry is grey, BGR24 otherwise
+    void expand_palette() {
+        if (pixel_format != PixelFormat::Indexed8) {
+            return;
+        }
+        if (palette_is_grey()) {
+            apply_grey_palette();
+            update_layout();
+        } else {
+            to_bgr24();
+        }
+    }
+
+    void to_bgr24() {
+        if (pixel_format != PixelFormat::Gray8 && pixel_format != PixelFormat::Indexed8) {
+            return;
+        }
+
+        std::vector<uint8_t> pixels(data.size() * 3);
+        for (size_t i = 0; i < data.size(); ++i) {
+            uint32_t color = data[i] < palette.size() ? palette[data[i]] : 0;
+            pixels[3 * i + 0] = color & 0xff;
+            pixels[3 * i + 1] = (color >> 8) & 0xff;
+            pixels[3 * i + 2] = (color >> 16) & 0xff;
+        }
+
+        data.swap(pixels);
+        palette.clear();
+        bmp_info_header.bit_count = 24;
+        bmp_info_header.compression = BI_RGB;
+        pixel_format = PixelFormat::BGR24;
+        row_stride = bmp_info_header.width * 3;
+        update_layout();
+    }
+
     // -----/ FILTER FUNCTIONS /-----
+    // Every filter has an ImageView overload, so it can be applied to any
+    // window of an image (or of another buffer) without copying it out first.
 
     void get_pixel(uint32_t x0, uint32_t y0, uint8_t *R, uint8_t *G, uint8_t *B, uint8_t *A) {
         if (x0 >= (uint32_t) bmp_info_header.width || y0 >= (uint32_t) bmp_info_header.height || x0 < 0 || y0 < 0) {
             throw std::runtime_error("The point is outside the image boundaries!");
         }
 
-        uint32_t channels = bmp_info_header.bit_count / 8;
-        *B = data[channels * (y0 * bmp_info_header.width + x0) + 0];
-        *G = data[channels * (y0 * bmp_info_header.width + x0) + 1];
-        *R = data[channels * (y0 * bmp_info_header.width + x0) + 2];
-        if (channels == 4) {
-            *A = data[channels * (y0 * bmp_info_header.width + x0) + 3];
+        ImageView img = view();
+        uint8_t *pix = img.pixel(x0, y0);
+        if (img.format == PixelFormat::Indexed8) {
+            uint32_t color = *pix < palette.size() ? palette[*pix] : 0;
+            *B = color & 0xff;
+            *G = (color >> 8) & 0xff;
+            *R = (color >> 16) & 0xff;
+            return;
+        }
+        if (img.channels() == 1) {
+            *B = *G = *R = pix[0];
+            return;
+        }
+        *B = pix[0];
+        *G = pix[1];
+        *R = pix[2];
+        if (img.channels() == 4) {
+            *A = pix[3];
         }
     }
 
@@ -214,21 +364,12 @@ struct BMP {
             throw std::runtime_error("The point is outside the image boundaries!");
         }
 
-        uint32_t channels = bmp_info_header.bit_count / 8;
-        if (data[channels * (y0 * bmp_info_header.width + x0) + 0] != B) {
-            return 0;
+        ImageView img = view();
+        if (img.format == PixelFormat::Indexed8) {
+            uint8_t index = *img.pixel(x0, y0);
+            return index < palette.size() && (palette[index] & 0x00ffffff) == pack_color(R, G, B);
         }
-        if (data[channels * (y0 * bmp_info_header.width + x0) + 1] != G) {
-            return 0;
-        }
-        if (data[channels * (y0 * bmp_info_header.width + x0) + 2] != R) {
-            return 0;
-        }
-        if (channels == 4 && data[channels * (y0 * bmp_info_header.width + x0) + 3] != A) {
-            return 0;
-        }
-
-        return 1;
+        return check_pixel(img.pixel(x0, y0), img.channels(), R, G, B, A);
     }
 
     void set_pixel(uint32_t x0, uint32_t y0, uint8_t R, uint8_t G, uint8_t B, uint8_t A) {
@@ -236,38 +377,64 @@ struct BMP {
             throw std::runtime_error("The point is outside the image boundaries!");
         }
 
-        uint32_t channels = bmp_info_header.bit_count / 8;
-        data[channels * (y0 * bmp_info_header.width + x0) + 0] = B;
-        data[channels * (y0 * bmp_info_header.width + x0) + 1] = G;
-        data[channels * (y0 * bmp_info_header.width + x0) + 2] = R;
+        fit_color(R, G, B);
+        ImageView img = view();
+        set_pixel(img.pixel(x0, y0), img.channels(), R, G, B, A);
+    }
 
-        if (channels == 4) {
-            data[channels * (y0 * bmp_info_header.width + x0) + 3] = A;
+    void negative() {
+        if (pixel_format == PixelFormat::Indexed8) {
+            for (uint32_t &color : palette) {
+                color ^= 0x00ffffff;
+            }
+            return;
         }
+        negative(view());
     }
 
-    void negative() {
-        uint32_t channels = bmp_info_header.bit_count / 8;
+    static void negative(ImageView img) {
+        check_direct_color(img);
+        uint32_t channels = img.channels();
+        uint32_t color_channels = std::min(channels, 3u);
 
-        for (uint32_t x0 = 0; x0 < (uint32_t) bmp_info_header.width; ++x0) {
-            for (uint32_t y0 = 0; y0 < (uint32_t) bmp_info_header.height; ++y0) {
-                data[channels * (y0 * bmp_info_header.width + x0) + 0] = 255 -
-                            data[channels * (y0 * bmp_info_header.width + x0) + 0];
-                data[channels * (y0 * bmp_info_header.width + x0) + 1] = 255 -
-                            data[channels * (y0 * bmp_info_header.width + x0) + 1];
-                data[channels * (y0 * bmp_info_header.width + x0) + 2] = 255 -
-                            data[channels * (y0 * bmp_info_header.width + x0) + 2];
+        for (uint32_t y0 = 0; y0 < img.height; ++y0) {
+            uint8_t *pix = img.row(y0);
+            for (uint32_t x0 = 0; x0 < img.width; ++x0, pix += channels) {
+                for (uint32_t k = 0; k < color_channels; ++k) {
+                    pix[k] = 255 - pix[k];
+                }
             }
         }
     }
 
-    size_t replace_color(uint8_t R1, uint8_t G1, uint8_t B1, uint8_t A1, uint8_t R2, uint8_t G2, uint8_t B2, uint8_t A2 = 1) {
+    // With a tolerance every color within that RGB distance of (R1, G1, B1) is replaced
+    size_t replace_color(uint8_t R1, uint8_t G1, uint8_t B1, uint8_t A1, uint8_t R2, uint8_t G2, uint8_t B2, uint8_t A2 = 1,
+                         uint32_t tolerance = 0) {
+        if (pixel_format == PixelFormat::Indexed8) {
+            return replace_palette_color(pack_color(R1, G1, B1), pack_color(R2, G2, B2), tolerance);
+        }
+        if (pixel_format == PixelFormat::Gray8) {
+            if (!tolerance && (R1 != G1 || G1 != B1)) {
+                return 0;
+            }
+            fit_color(R2, G2, B2);
+        }
+        return replace_color(view(), R1, G1, B1, A1, R2, G2, B2, A2, tolerance);
+    }
+
+    static size_t replace_color(ImageView img, uint8_t R1, uint8_t G1, uint8_t B1, uint8_t A1,
+                                uint8_t R2, uint8_t G2, uint8_t B2, uint8_t A2 = 1, uint32_t tolerance = 0) {
+        check_direct_color(img);
+        uint32_t channels = img.channels();
+        uint32_t tolerance2 = tolerance * tolerance;
         size_t changed_pixels_counter = 0;
 
-        for (uint32_t x0 = 0; x0 < (uint32_t) bmp_info_header.width; ++x0) {
-            for (uint32_t y0 = 0; y0 < (uint32_t) bmp_info_header.height; ++y0) {
-                if (check_pixel(x0, y0, R1, G1, B1, A1)) {
-                    set_pixel(x0, y0, R2, G2, B2, A2);
+        for (uint32_t y0 = 0; y0 < img.height; ++y0) {
+            uint8_t *pix = img.row(y0);
+            for (uint32_t x0 = 0; x0 < img.width; ++x0, pix += channels) {
+                if (tolerance ? check_pixel_near(pix, channels, R1, G1, B1, A1, tolerance2)
+                              : check_pixel(pix, channels, R1, G1, B1, A1)) {
+                    set_pixel(pix, channels, R2, G2, B2, A2);
                     ++changed_pixels_counter;
                 }
             }
@@ -277,217 +444,382 @@ struct BMP {
         return changed_pixels_counter;
     }
 
+    // Saturation, hue and vibrance (see ColorAdjust) in one pass; Indexed8 images change the palette
+    void adjust_colors(const ColorAdjust &adjust) {
+        if (pixel_format == PixelFormat::Indexed8) {
+            ImageView colors{ (uint8_t*) palette.data(), (uint32_t) palette.size(), 1,
+                              (ptrdiff_t) (4 * palette.size()), PixelFormat::BGRA32 };
+            ColorTransform(adjust).apply(colors);
+            return;
+        }
+        adjust_colors(view(), adjust);
+    }
+
+    static void adjust_colors(ImageView img, const ColorAdjust &adjust) {
+        check_direct_color(img);
+        ColorTransform(adjust).apply(img);
+    }
+
+    // Grey by perceived brightness, unlike grey() which averages the channels
+    void luma_grey(LumaStandard standard = LumaStandard::Rec601) {
+        ColorAdjust adjust;
+        adjust.standard = standard;
+        adjust.saturation = 0;
+        adjust_colors(adjust);
+    }
+
+    static void luma_grey(ImageView img, LumaStandard standard = LumaStandard::Rec601) {
+        ColorAdjust adjust;
+        adjust.standard = standard;
+        adjust.saturation = 0;
+        adjust_colors(img, adjust);
+    }
+
     void clarity(double div = 8) {
+        expand_palette();
+        clarity(view(), div);
+    }
+
+    static void clarity(ImageView img, double div = 8) {
         // div <=> clarity force
-        uint32_t channels = bmp_info_header.bit_count / 8;
+        check_direct_color(img);
+        uint32_t channels = img.channels();
+        int32_t width = (int32_t) img.width;
+        int32_t height = (int32_t) img.height;
         struct clarity_matrix c_mx;
         double new_pixel;
-        std::vector<uint8_t> new_data = data;
+        std::vector<uint8_t> data = copy_pixels(img);
 
-        for (int32_t x0 = 0; x0 < (int32_t) bmp_info_header.width; ++x0) {
-            for (int32_t y0 = 0; y0 < (int32_t) bmp_info_header.height; ++y0) {
+        for (int32_t x0 = 0; x0 < width; ++x0) {
+            for (int32_t y0 = 0; y0 < height; ++y0) {
                 for (uint32_t k = 0; k < channels; ++k) {
                     int central_clarity_coeff = 8;
-                    if (!x0 || x0 == bmp_info_header.width - 1) {
+                    if (!x0 || x0 == width - 1) {
                         central_clarity_coeff -= 3;
                     }
-                    if (!y0 || y0 == bmp_info_header.height - 1) {
+                    if (!y0 || y0 == height - 1) {
                         central_clarity_coeff -= 3;
                     }
                     if (central_clarity_coeff == 3) {
                         ++central_clarity_coeff;
                     }
-                    new_pixel = data[channels * ((y0) * bmp_info_header.width + (x0)) + k];
-                    new_pixel += (data[channels * ((y0) * bmp_info_header.width + (x0)) + k] * central_clarity_coeff) / div;
+                    new_pixel = data[channels * ((y0) * width + (x0)) + k];
+                    new_pixel += (data[channels * ((y0) * width + (x0)) + k] * central_clarity_coeff) / div;
 
-                    for (int32_t i = -std::min(c_mx.deviation, bmp_info_header.height - y0 - 1);
+                    for (int32_t i = -std::min(c_mx.deviation, height - y0 - 1);
                                     i <= std::min(c_mx.deviation, y0); ++i) {
-                        for (int32_t j = std::max(-c_mx.deviation, -x0); j <= 
-                                        std::min(c_mx.deviation, bmp_info_header.width - x0 - 1); ++j) {
+                        for (int32_t j = std::max(-c_mx.deviation, -x0); j <=
+                                        std::min(c_mx.deviation, width - x0 - 1); ++j) {
                             if (!i && !j) {
                                 continue;
                             }
-                            
-                            if (data[channels * ((y0 - i) * bmp_info_header.width + (x0 + j)) + k] > new_pixel) {
+
+                            if (data[channels * ((y0 - i) * width + (x0 + j)) + k] > new_pixel) {
                                 new_pixel = 0;
                                 break;
                             }
-                            new_pixel += (data[channels * ((y0 - i) * bmp_info_header.width + (x0 + j)) + k] * 
+                            new_pixel += (data[channels * ((y0 - i) * width + (x0 + j)) + k] *
                                             c_mx.data[c_mx.deviation + i][c_mx.deviation + j]) / div;
                         }
                     }
-                    
+
                     if (new_pixel != 0) {
-                        new_data[channels * (y0 * bmp_info_header.width + x0) + k] = (uint8_t) new_pixel;
+                        img.pixel(x0, y0)[k] = (uint8_t) new_pixel;
                     }
                 }
             }
         }
 
-        data = new_data;
         // median_filter(1);
     }
 
     void gauss() {
-        uint32_t channels = bmp_info_header.bit_count / 8;
+        expand_palette();
+        gauss(view());
+    }
+
+    static void gauss(ImageView img) {
+        check_direct_color(img);
+        uint32_t channels = img.channels();
+        int32_t width = (int32_t) img.width;
+        int32_t height = (int32_t) img.height;
         struct gauss_matrix g_mx;
         uint8_t new_pixel;
-        std::vector<uint8_t> new_data = data;
+        std::vector<uint8_t> data = copy_pixels(img);
 
-        for (int32_t x0 = 0; x0 < (int32_t) bmp_info_header.width; ++x0) {
-            for (int32_t y0 = 0; y0 < (int32_t) bmp_info_header.height; ++y0) {
+        for (int32_t x0 = 0; x0 < width; ++x0) {
+            for (int32_t y0 = 0; y0 < height; ++y0) {
                 for (uint32_t k = 0; k < channels; ++k) {
                     new_pixel = 0;
-                    for (int32_t i = -std::min(g_mx.deviation, bmp_info_header.height - y0 - 1); 
+                    for (int32_t i = -std::min(g_mx.deviation, height - y0 - 1);
                                     i <= std::min(g_mx.deviation, y0); ++i) {
-                        for (int32_t j = std::max(-g_mx.deviation, -x0); j <= 
-                                        std::min(g_mx.deviation, bmp_info_header.width - x0 - 1); ++j) {
-                            new_pixel += data[channels * ((y0 - i) * bmp_info_header.width + (x0 + j)) + k] * 
+                        for (int32_t j = std::max(-g_mx.deviation, -x0); j <=
+                                        std::min(g_mx.deviation, width - x0 - 1); ++j) {
+                            new_pixel += data[channels * ((y0 - i) * width + (x0 + j)) + k] *
                                             g_mx.data[g_mx.deviation + i][g_mx.deviation + j];
                         }
                     }
-                    new_data[channels * (y0 * bmp_info_header.width + x0) + k] = new_pixel;
+                    img.pixel(x0, y0)[k] = new_pixel;
                 }
             }
         }
-
-        data = new_data;
     }
 
     void grey() {
-        uint32_t channels = bmp_info_header.bit_count / 8;
+        if (pixel_format == PixelFormat::Indexed8) {
+            for (uint32_t &color : palette) {
+                uint8_t new_color = ((color & 0xff) + ((color >> 8) & 0xff) + ((color >> 16) & 0xff)) / 3;
+                color = (color & 0xff000000) | pack_color(new_color, new_color, new_color);
+            }
+            return;
+        }
+        grey(view());
+    }
+
+    static void grey(ImageView img) {
+        check_direct_color(img);
+        uint32_t channels = img.channels();
+        if (channels == 1) {
+            return;
+        }
         uint8_t new_color = 0;
 
-        for (uint32_t x0 = 0; x0 < (uint32_t) bmp_info_header.width; ++x0) {
-            for (uint32_t y0 = 0; y0 < (uint32_t) bmp_info_header.height; ++y0) {
-                new_color = (
-                        data[channels * (y0 * bmp_info_header.width + x0) + 0] +
-                        data[channels * (y0 * bmp_info_header.width + x0) + 1] +
-                        data[channels * (y0 * bmp_info_header.width + x0) + 2]
-                ) / 3;
+        for (uint32_t y0 = 0; y0 < img.height; ++y0) {
+            uint8_t *pix = img.row(y0);
+            for (uint32_t x0 = 0; x0 < img.width; ++x0, pix += channels) {
+                new_color = (pix[0] + pix[1] + pix[2]) / 3;
                 for (uint32_t i = 0; i < 3; ++i) {
-                    data[channels * (y0 * bmp_info_header.width + x0) + i] = new_color;
+                    pix[i] = new_color;
                 }
             }
         }
     }
 
     void sobel() {
+        expand_palette();
+        sobel(view());
+    }
+
+    static void sobel(ImageView img) {
         // negative();
-        uint32_t channels = bmp_info_header.bit_count / 8;
+        check_direct_color(img);
+        uint32_t channels = img.channels();
+        int32_t width = (int32_t) img.width;
+        int32_t height = (int32_t) img.height;
         struct sobel_matrix s_mx;
         int16_t new_pixel_x, new_pixel_y;
-        std::vector<uint8_t> new_data = data;
+        std::vector<uint8_t> data = copy_pixels(img);
 
-        for (int32_t x0 = 0; x0 < (int32_t) bmp_info_header.width; ++x0) {
-            for (int32_t y0 = 0; y0 < (int32_t) bmp_info_header.height; ++y0) {
+        for (int32_t x0 = 0; x0 < width; ++x0) {
+            for (int32_t y0 = 0; y0 < height; ++y0) {
                 for (uint32_t k = 0; k < channels; ++k) {
                 new_pixel_x = 0;
                 new_pixel_y = 0;
-                for (int32_t i = -std::min(s_mx.deviation, y0); i <= 
-                                std::min(s_mx.deviation, bmp_info_header.height - y0 - 1); ++i) {
-                    for (int32_t j = -std::min(s_mx.deviation, x0); j <= 
-                                    std::min(s_mx.deviation, bmp_info_header.width - x0 - 1); ++j) {
-                        new_pixel_x += data[channels * ((y0 + i) * bmp_info_header.width + (x0 + j)) + k] * 
+                for (int32_t i = -std::min(s_mx.deviation, y0); i <=
+                                std::min(s_mx.deviation, height - y0 - 1); ++i) {
+                    for (int32_t j = -std::min(s_mx.deviation, x0); j <=
+                                    std::min(s_mx.deviation, width - x0 - 1); ++j) {
+                        new_pixel_x += data[channels * ((y0 + i) * width + (x0 + j)) + k] *
                                     s_mx.dataX[s_mx.deviation + i][s_mx.deviation + j];
-                        new_pixel_y += data[channels * ((y0 + i) * bmp_info_header.width + (x0 + j)) + k] * 
+                        new_pixel_y += data[channels * ((y0 + i) * width + (x0 + j)) + k] *
                                     s_mx.dataY[s_mx.deviation + i][s_mx.deviation + j];
                     }
                 }
 
-                new_data[channels * (y0 * bmp_info_header.width + x0) + k] = 
+                img.pixel(x0, y0)[k] =
                             (int8_t) std::sqrt(new_pixel_x * new_pixel_x + new_pixel_y * new_pixel_y);
                 }
             }
         }
-
-        data = new_data;
     }
 
     void median_filter(int median_area = 1) {
-        uint32_t channels = bmp_info_header.bit_count / 8;
+        expand_palette();
+        median_filter(view(), median_area);
+    }
+
+    static void median_filter(ImageView img, int median_area = 1) {
+        check_direct_color(img);
+        uint32_t channels = img.channels();
+        int32_t width = (int32_t) img.width;
+        int32_t height = (int32_t) img.height;
         std::vector<uint8_t> buff;
         int8_t med_pix_count = 0;
-        std::vector<uint8_t> new_data = data;
-        for (int32_t x = 0; x < (int32_t) bmp_info_header.width; ++x) {
-            for (int32_t y = 0; y < (int32_t) bmp_info_header.height; ++y) {
+        std::vector<uint8_t> data = copy_pixels(img);
+        for (int32_t x = 0; x < width; ++x) {
+            for (int32_t y = 0; y < height; ++y) {
                 for (uint32_t k = 0; k < channels; ++k) {
                     buff.clear();
                     med_pix_count = 0;
-                    for (int32_t i = -std::min(median_area, x); i <= std::min(median_area, bmp_info_header.width - x - median_area); ++i) {
-                        for (int32_t j = -std::min(median_area, y); j <= std::min(median_area, bmp_info_header.height - y - median_area); ++j) {
-                            buff.push_back(data[channels * ((y + j) * bmp_info_header.width + (x + i)) + k]);
+                    for (int32_t i = -std::min(median_area, x); i <= std::min(median_area, width - x - median_area); ++i) {
+                        for (int32_t j = -std::min(median_area, y); j <= std::min(median_area, height - y - median_area); ++j) {
+                            buff.push_back(data[channels * ((y + j) * width + (x + i)) + k]);
                             ++med_pix_count;
                         }
                     }
                     std::sort(buff.begin(), buff.end());
-                    new_data[channels * (y * bmp_info_header.width + x) + k] = buff[med_pix_count >> 1];
+                    img.pixel(x, y)[k] = buff[med_pix_count >> 1];
                 }
             }
         }
+    }
 
-        data = new_data;
+    // Morphology with a w x h rectangle: every color channel gets the minimum (erode) or
+    // maximum (dilate) of the window around the pixel; alpha is kept. Rows and columns are
+    // filtered separately with the van Herk/Gil-Werman running extreme, so the
+    // cost per pixel does not depend on the window size.
+    void erode(uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        expand_palette();
+        erode(view(), w, h, threads);
     }
 
-    void viniette(double radius = 1.0, double power = 0.8) {
-        uint32_t channels = bmp_info_header.bit_count / 8;
-        int32_t curr_x = (int32_t) (bmp_info_header.width >> 1);
-        int32_t curr_y = (int32_t) (bmp_info_header.height >> 1);
-        double max_radius = (std::sqrt(curr_x * curr_x + curr_y * curr_y)) * radius;
-
-        double force = 0;
-        for (uint32_t x = 0; x < (uint32_t) bmp_info_header.width; ++x) {
-            for (uint32_t y = 0; y < (uint32_t) bmp_info_header.height; ++y) {
-                force = viniette_dist(curr_x, curr_y, x, y) / max_radius;
-                force *= power;
-                force = pow(cos(force), 4);
-                for (uint32_t k = 0; k < channels; ++k) {
-                    data[channels * (y * bmp_info_header.width + x) + k] *= force;
+    static void erode(ImageView img, uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        check_direct_color(img);
+        check_window(w, h);
+        morphology_pass<false>(img, w, h, (w - 1) / 2, (h - 1) / 2, threads);
+    }
+
+    void dilate(uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        expand_palette();
+        dilate(view(), w, h, threads);
+    }
+
+    static void dilate(ImageView img, uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        check_direct_color(img);
+        check_window(w, h);
+        // Reflected window, so opening and closing stay idempotent for even sizes too
+        morphology_pass<true>(img, w, h, w / 2, h / 2, threads);
+    }
+
+    void opening(uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        expand_palette();
+        opening(view(), w, h, threads);
+    }
+
+    static void opening(ImageView img, uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        erode(img, w, h, threads);
+        dilate(img, w, h, threads);
+    }
+
+    void closing(uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        expand_palette();
+        closing(view(), w, h, threads);
+    }
+
+    static void closing(ImageView img, uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        dilate(img, w, h, threads);
+        erode(img, w, h, threads);
+    }
+
+    // White top-hat: the image minus its opening, i.e. the bright details smaller than the window
+    void top_hat(uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        expand_palette();
+        top_hat(view(), w, h, threads);
+    }
+
+    static void top_hat(ImageView img, uint32_t w, uint32_t h, unsigned threads = std::thread::hardware_concurrency()) {
+        std::vector<uint8_t> data = copy_pixels(img);
+        opening(img, w, h, threads);
+
+        uint32_t row_bytes = img.row_bytes();
+        uint32_t channels = img.channels();
+        uint32_t color_channels = std::min(channels, 3u);
+        for (uint32_t y = 0; y < img.height; ++y) {
+            const uint8_t *src = data.data() + (size_t) row_bytes * y;
+            uint8_t *dst = img.row(y);
+            for (uint32_t i = 0; i < row_bytes; i += channels) {
+                for (uint32_t k = 0; k < color_channels; ++k) {
+                    dst[i + k] = src[i + k] - dst[i + k];
                 }
             }
         }
     }
 
+    void viniette(double radius = 1.0, double power = 0.8) {
+        expand_palette();
+        viniette(view(), radius, power);
+    }
+
+    // The mask only depends on the size, radius and power, so it is cached (see VignetteMask)
+    static void viniette(ImageView img, double radius = 1.0, double power = 0.8) {
+        check_direct_color(img);
+        VignetteMask::get(img.width, img.height, radius, power)->apply(img);
+    }
+
+    // Premultiplied copy of the image for overlay(): build it once when the
+    // same image is composited onto many others
+    Layer layer() {
+        return Layer(view(), palette.data(), palette.size());
+    }
+
+    // Composites `src` with its bottom-left corner at (x0, y0), clipped to this image.
+    // Gray8 and Indexed8 images become BGR24 first.
+    void overlay(const Layer &src, int32_t x0, int32_t y0, BlendMode mode = BlendMode::Over, uint8_t opacity = 255,
+                 unsigned threads = std::thread::hardware_concurrency()) {
+        if (pixel_format != PixelFormat::BGR24 && pixel_format != PixelFormat::BGRA32) {
+            to_bgr24();
+        }
+        src.draw(view(), x0, y0, mode, opacity, threads);
+    }
+
+    void overlay(BMP &src, int32_t x0, int32_t y0, BlendMode mode = BlendMode::Over, uint8_t opacity = 255,
+                 unsigned threads = std::thread::hardware_concurrency()) {
+        overlay(src.layer(), x0, y0, mode, opacity, threads);
+    }
+
+    // Moves the (x0, y0, w, h) window to the front of `data` row by row and
+    // releases the rest of the buffer. Use view(x0, y0, w, h) instead when
+    // the region is only needed for further filtering.
     void frame(uint32_t x0, uint32_t y0, uint32_t w, uint32_t h) {
-        if (x0 + w > (uint32_t) bmp_info_header.width || y0 + h > (uint32_t) bmp_info_header.height) {
+        if (!region_fits(x0, y0, w, h, bmp_info_header.width, bmp_info_header.height)) {
             throw std::runtime_error("The region does not fit in the image!");
         }
 
-        uint32_t channels = bmp_info_header.bit_count / 8;
+        // Walk the rows in storage order, so every row moves towards the front of the buffer
+        uint32_t channels = format_channels(pixel_format);
+        uint32_t new_stride = w * channels;
+        uint32_t first_row = top_down ? bmp_info_header.height - y0 - h : y0;
         for (uint32_t y = 0; y < h; ++y) {
-            for (uint32_t x = 0; x < w; ++x) {
-                for (uint32_t k = 0; k < channels; ++k) {
-                    data[channels * (y * w + x) + k] = 
-                            data[channels * ((y + y0) * bmp_info_header.width + (x + x0)) + k];
-                }
-            }
+            std::memmove(data.data() + (size_t) new_stride * y,
+                            data.data() + (size_t) row_stride * (first_row + y) + x0 * channels, new_stride);
         }
+        data.resize((size_t) new_stride * h);
+        data.shrink_to_fit();
+
         bmp_info_header.height = h;
         bmp_info_header.width  = w;
+        row_stride = new_stride;
+        update_file_size();
     }
 
     void resize(uint32_t new_width, uint32_t new_height) {
-        uint32_t channels = bmp_info_header.bit_count / 8;
+        ImageView img = view();
+        uint32_t channels = img.channels();
         std::vector<uint8_t> new_data(channels * new_width * new_height);
 
         for (uint32_t x = 0; x < (uint32_t) new_width; ++x) {
             for (uint32_t y = 0; y < (uint32_t) new_height; ++y) {
                 for (uint32_t k = 0; k < channels; ++k) {
-                    new_data[channels * (y * new_width + x) + k] = 
-                    data[channels * (y * bmp_info_header.width * (bmp_info_header.height / new_height) + 
-                                    x * (bmp_info_header.width / new_width)) + k];
+                    new_data[channels * (y * new_width + x) + k] =
+                    img.pixel(x * (img.width / new_width), y * (img.height / new_height))[k];
                 }
             }
         }
 
         data = new_data;
+        top_down = false;
         bmp_info_header.width = new_width;
         bmp_info_header.height = new_height;
+        row_stride = channels * new_width;
+        update_file_size();
     }
 
 
 private:
+    friend class EditHistory;   // Snapshots and restores the layout below
+
     uint32_t row_stride{ 0 };
+    PixelFormat pixel_format{ PixelFormat::BGR24 };
 
     struct clarity_matrix {
         int32_t deviation = 1;
@@ -523,22 +855,475 @@ private:
         };
     };
 
-    double viniette_dist(int32_t a_x, int32_t a_y, int32_t b_x, int32_t b_y) {
-        a_x -= b_x; a_y -= b_y;
-        return (double) std::sqrt((double) (a_x * a_x + a_y * a_y));
+    static int check_pixel_near(const uint8_t *pix, uint32_t channels, uint8_t R, uint8_t G, uint8_t B, uint8_t A,
+                                uint32_t tolerance2) {
+        if (channels == 4 && pix[3] != A) {
+            return 0;
+        }
+        uint8_t bgr[3] = { pix[0], pix[channels == 1 ? 0 : 1], pix[channels == 1 ? 0 : 2] };
+        return color_distance2(bgr, B, G, R) <= tolerance2;
+    }
+
+    static int check_pixel(const uint8_t *pix, uint32_t channels, uint8_t R, uint8_t G, uint8_t B, uint8_t A) {
+        if (channels == 1) {
+            return pix[0] == B && B == G && G == R;
+        }
+        if (pix[0] != B || pix[1] != G || pix[2] != R) {
+            return 0;
+        }
+        if (channels == 4 && pix[3] != A) {
+            return 0;
+        }
+
+        return 1;
+    }
+
+    static void set_pixel(uint8_t *pix, uint32_t channels, uint8_t R, uint8_t G, uint8_t B, uint8_t A) {
+        if (channels == 1) {
+            pix[0] = (R + G + B) / 3;
+            return;
+        }
+        pix[0] = B;
+        pix[1] = G;
+        pix[2] = R;
+
+        if (channels == 4) {
+            pix[3] = A;
+        }
+    }
+
+    static uint32_t pack_color(uint8_t R, uint8_t G, uint8_t B) {
+        return ((uint32_t) R << 16) | ((uint32_t) G << 8) | B;
     }
 
-    void write_headers(std::ofstream &of) {
-        of.write((const char*) &file_header, sizeof(file_header));
-        of.write((const char*) &bmp_info_header, sizeof(bmp_info_header));
+    // Palette indices are not pixel values: BMP members expand them before filtering
+    static void check_direct_color(const ImageView &img) {
+        if (img.format == PixelFormat::Indexed8) {
+            throw std::runtime_error("The filter can not be applied to palette indices! Use expand_palette() first");
+        }
+    }
+
+    static std::vector<uint32_t> grey_palette() {
+        std::vector<uint32_t> grey(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            grey[i] = pack_color(i, i, i);
+        }
+        return grey;
+    }
+
+    bool palette_is_grey() const {
+        for (uint32_t color : palette) {
+            if (((color >> 16) & 0xff) != (color & 0xff) || ((color >> 8) & 0xff) != (color & 0xff)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Replaces indices by their grey levels and switches to the identity palette of Gray8
+    void apply_grey_palette() {
+        uint8_t levels[256] = {0};
+        bool identity = palette.size() == 256;
+        for (uint32_t i = 0; i < palette.size() && i < 256; ++i) {
+            levels[i] = palette[i] & 0xff;
+            identity = identity && levels[i] == i;
+        }
+        if (!identity) {
+            for (uint8_t &pix : data) {
+                pix = levels[pix];
+            }
+        }
+        palette = grey_palette();
+        pixel_format = PixelFormat::Gray8;
+    }
+
+    // Gray8 can only hold grey and Indexed8 only its palette: anything else needs BGR24
+    void fit_color(uint8_t R, uint8_t G, uint8_t B) {
+        if (pixel_format == PixelFormat::Indexed8 || (pixel_format == PixelFormat::Gray8 && (R != G || G != B))) {
+            to_bgr24();
+        }
+    }
+
+    size_t replace_palette_color(uint32_t old_color, uint32_t new_color, uint32_t tolerance = 0) {
+        size_t histogram[256] = {0};
+        for (uint8_t pix : data) {
+            ++histogram[pix];
+        }
+
+        size_t changed_pixels_counter = 0;
+        for (size_t i = 0; i < palette.size(); ++i) {
+            const uint8_t *bgr = (const uint8_t*) &palette[i];
+            if (color_distance2(bgr, old_color & 0xff, (old_color >> 8) & 0xff, old_color >> 16) <= tolerance * tolerance) {
+                palette[i] = (palette[i] & 0xff000000) | new_color;
+                changed_pixels_counter += histogram[i];
+            }
+        }
+        return changed_pixels_counter;
+    }
+
+    // Contiguous copy of a view, used as the read-only source by the neighbourhood filters
+    static std::vector<uint8_t> copy_pixels(ImageView img) {
+        uint32_t row_bytes = img.row_bytes();
+        std::vector<uint8_t> pixels(row_bytes * img.height);
+        for (uint32_t y = 0; y < img.height; ++y) {
+            std::memcpy(pixels.data() + row_bytes * y, img.row(y), row_bytes);
+        }
+        return pixels;
+    }
+
+    static void check_window(uint32_t w, uint32_t h) {
+        if (!w || !h) {
+            throw std::runtime_error("The structuring element must be at least 1x1!");
+        }
+    }
+
+    // Columns are filtered in tiles of this many bytes, all of them in one pass over the rows
+    static constexpr uint32_t morphology_tile = 64;
+
+    template <bool is_max>
+    static void morphology_pass(ImageView img, uint32_t w, uint32_t h, uint32_t anchor_x, uint32_t anchor_y,
+                                unsigned threads) {
+        uint32_t channels = img.channels();
+        // The columns are filtered as whole bytes, alpha with them: it is saved and put back
+        std::vector<uint8_t> alpha;
+        if (channels == 4 && (w > 1 || h > 1)) {
+            alpha.resize((size_t) img.width * img.height);
+            for (uint32_t y = 0; y < img.height; ++y) {
+                const uint8_t *pix = img.row(y);
+                for (uint32_t x = 0; x < img.width; ++x) {
+                    alpha[(size_t) img.width * y + x] = pix[4 * x + 3];
+                }
+            }
+        }
+
+        if (w > 1) {
+            run_parallel(img.height, threads, [&](size_t begin, size_t end) {
+                std::vector<uint8_t> forward((img.width + w - 1) * channels);
+                std::vector<uint8_t> backward(forward.size());
+                for (size_t y = begin; y < end; ++y) {
+                    running_extreme<is_max>(img.row(y), channels, img.width, channels, w, anchor_x,
+                                            forward.data(), backward.data());
+                }
+            });
+        }
+
+        uint32_t row_bytes = img.row_bytes();
+        if (h > 1) {
+            run_parallel((row_bytes + morphology_tile - 1) / morphology_tile, threads, [&](size_t begin, size_t end) {
+                std::vector<uint8_t> forward((size_t) (img.height + h - 1) * morphology_tile);
+                std::vector<uint8_t> backward(forward.size());
+                for (size_t tile = begin; tile < end; ++tile) {
+                    uint32_t offset = tile * morphology_tile;
+                    running_extreme<is_max>(img.row(0) + offset, img.stride, img.height,
+                                            std::min(morphology_tile, row_bytes - offset), h, anchor_y,
+                                            forward.data(), backward.data());
+                }
+            });
+        }
+
+        for (uint32_t y = 0; y < img.height && !alpha.empty(); ++y) {
+            uint8_t *pix = img.row(y);
+            for (uint32_t x = 0; x < img.width; ++x) {
+                pix[4 * x + 3] = alpha[(size_t) img.width * y + x];
+            }
+        }
+    }
+
+    // Van Herk/Gil-Werman: element x of the line becomes the extreme of elements
+    // [x - anchor, x - anchor + k - 1], elements out of the line are skipped.
+    // The padded line is cut into blocks of k; a window always spans the tail of
+    // one block and the head of the next, so it is the extreme of one backward
+    // and one forward running value: 3 comparisons per element for any k.
+    // An element is `lanes` bytes filtered independently, `step` bytes apart.
+    template <bool is_max>
+    static void running_extreme(uint8_t *line, ptrdiff_t step, uint32_t n, uint32_t lanes, uint32_t k,
+                                uint32_t anchor, uint8_t *forward, uint8_t *backward) {
+        uint8_t identity[morphology_tile];
+        std::memset(identity, is_max ? 0 : 255, lanes);
+        auto padded = [&](uint32_t i) -> const uint8_t* {
+            return i >= anchor && i - anchor < n ? line + step * (ptrdiff_t) (i - anchor) : identity;
+        };
+        auto extreme = [lanes](uint8_t *dst, const uint8_t *a, const uint8_t *b) {
+            for (uint32_t l = 0; l < lanes; ++l) {
+                dst[l] = is_max ? std::max(a[l], b[l]) : std::min(a[l], b[l]);
+            }
+        };
+
+        uint32_t padded_n = n + k - 1;
+        for (uint32_t i = 0; i < padded_n; ++i) {
+            if (i % k == 0) {
+                std::memcpy(forward + lanes * i, padded(i), lanes);
+            } else {
+                extreme(forward + lanes * i, forward + lanes * (i - 1), padded(i));
+            }
+        }
+        for (uint32_t i = padded_n; i-- > 0;) {
+            if (i % k == k - 1 || i == padded_n - 1) {
+                std::memcpy(backward + lanes * i, padded(i), lanes);
+            } else {
+                extreme(backward + lanes * i, backward + lanes * (i + 1), padded(i));
+            }
+        }
+        for (uint32_t x = 0; x < n; ++x) {
+            extreme(line + step * (ptrdiff_t) x, backward + lanes * x, forward + lanes * (x + k - 1));
+        }
+    }
+
+    void read_headers(std::istream &inp, const char *fname) {
+        inp.read((char*) &file_header, sizeof(file_header));
+        if (file_header.file_type != 0x4D42) {
+            throw std::runtime_error("Error! Unrecognized file format.");
+        }
+
+        inp.read((char*) &bmp_info_header, sizeof(bmp_info_header));
+
         if (bmp_info_header.bit_count == 32) {
-            of.write((const char*) &bmp_color_header, sizeof(bmp_color_header));
+            if (bmp_info_header.size >= (sizeof(BMPInfoHeader) + sizeof(BMPColorHeader))) {
+                inp.read((char*) &bmp_color_header, sizeof(bmp_color_header));
+                check_color_header(bmp_color_header);
+            } else {
+                std::cerr << "Error! The file \"" << fname << "\" does not seem to contain bit mask information\n";
+                throw std::runtime_error("Error! Unrecognized file format.");
+            }
+        }
+
+        uint16_t bits = bmp_info_header.bit_count;
+        uint32_t compression = bmp_info_header.compression;
+        if (bits != 1 && bits != 4 && bits != 8 && bits != 24 && bits != 32) {
+            throw std::runtime_error("The program can treat only 1, 4, 8, 24 or 32 bits per pixel BMP files");
+        }
+        if (!(compression == BI_RGB || (compression == BI_RLE8 && bits == 8) ||
+                (compression == BI_RLE4 && bits == 4) || (compression == BI_BITFIELDS && bits == 32))) {
+            throw std::runtime_error("Unsupported BMP compression!");
+        }
+
+        top_down = bmp_info_header.height < 0;
+        if (top_down) {
+            if (compression == BI_RLE8 || compression == BI_RLE4) {
+                throw std::runtime_error("Error! RLE compressed BMP images can not be top-down.");
+            }
+            bmp_info_header.height = -bmp_info_header.height;
+        }
+
+        palette.clear();
+        if (bits <= 8) {
+            uint32_t colors = bmp_info_header.colors_used;
+            if (colors == 0 || colors > (1u << bits)) {
+                colors = 1u << bits;
+            }
+            palette.resize(colors);
+            inp.seekg(sizeof(BMPFileHeader) + bmp_info_header.size, inp.beg);
+            inp.read((char*) palette.data(), colors * sizeof(uint32_t));
+            for (uint32_t &color : palette) {
+                color &= 0x00ffffff;
+            }
+        }
+    }
+
+    // Reads the (x0, y0, w, h) window of the pixel data. 1 and 4-bit rows are unpacked
+    // to one index per byte and RLE streams are decoded, so in memory every
+    // palettized image is 8-bit; grey palettes become Gray8 right away.
+    void read_pixels(std::istream &inp, uint32_t x0, uint32_t y0, uint32_t w, uint32_t h) {
+        if (!region_fits(x0, y0, w, h, bmp_info_header.width, bmp_info_header.height)) {
+            throw std::runtime_error("The region does not fit in the image!");
+        }
+
+        uint32_t width = bmp_info_header.width;
+        uint32_t bits = bmp_info_header.bit_count;
+        uint32_t channels = bits <= 8 ? 1 : bits / 8;
+        uint32_t file_stride = ((width * bits + 31) / 32) * 4;
+        std::streamoff pixels_begin = file_header.offset_data;
+        uint32_t first_row = top_down ? bmp_info_header.height - y0 - h : y0;
+        bool rle = bmp_info_header.compression == BI_RLE8 || bmp_info_header.compression == BI_RLE4;
+
+        row_stride = w * channels;
+        if (rle) {
+            inp.seekg(pixels_begin, inp.beg);
+            std::vector<uint8_t> stream((std::istreambuf_iterator<char>(inp)), std::istreambuf_iterator<char>());
+            if (bmp_info_header.size_image && bmp_info_header.size_image < stream.size()) {
+                stream.resize(bmp_info_header.size_image);
+            }
+            row_stride = width;
+            decode_rle(stream, bmp_info_header.compression == BI_RLE4);
+        } else if (bits < 8) {
+            std::vector<uint8_t> packed(file_stride);
+            size_t first_byte = (size_t) x0 * bits / 8;
+            size_t last_byte = ((size_t) (x0 + w) * bits + 7) / 8;
+            data.resize((size_t) row_stride * h);
+            for (uint32_t y = 0; y < h; ++y) {
+                inp.seekg(pixels_begin + (std::streamoff) (first_row + y) * file_stride + first_byte, inp.beg);
+                inp.read((char*) packed.data() + first_byte, last_byte - first_byte);
+                uint8_t *row = data.data() + (size_t) row_stride * y;
+                for (uint32_t x = 0; x < w; ++x) {
+                    size_t bit = (size_t) (x0 + x) * bits;
+                    row[x] = (packed[bit / 8] >> (8 - bits - bit % 8)) & ((1 << bits) - 1);
+                }
+            }
+        } else if (x0 == 0 && w == width) {
+            // Whole rows: one read for the band, then squeeze the padding out in place
+            inp.seekg(pixels_begin + (std::streamoff) first_row * file_stride, inp.beg);
+            data.resize((size_t) file_stride * h);
+            if (h > 0) {
+                inp.read((char*) data.data(), (size_t) file_stride * (h - 1) + row_stride);
+            }
+            if (file_stride != row_stride) {
+                for (uint32_t y = 1; y < h; ++y) {
+                    std::memmove(data.data() + (size_t) row_stride * y, data.data() + (size_t) file_stride * y, row_stride);
+                }
+            }
+        } else {
+            data.resize((size_t) row_stride * h);
+            for (uint32_t y = 0; y < h; ++y) {
+                inp.seekg(pixels_begin + (std::streamoff) (first_row + y) * file_stride + x0 * channels, inp.beg);
+                inp.read((char*) (data.data() + (size_t) row_stride * y), row_stride);
+            }
+        }
+
+        if (!rle && !inp) {
+            throw std::runtime_error("Error! Unexpected end of the pixel data.");
+        }
+
+        if (bits <= 8) {
+            bmp_info_header.bit_count = 8;
+            pixel_format = PixelFormat::Indexed8;
+            if (palette_is_grey()) {
+                apply_grey_palette();
+            }
+        } else {
+            pixel_format = bits == 32 ? PixelFormat::BGRA32 : PixelFormat::BGR24;
+        }
+
+        if (rle) {
+            data.resize((size_t) row_stride * bmp_info_header.height);
+            update_layout();
+            if (x0 != 0 || y0 != 0 || w != width || h != (uint32_t) bmp_info_header.height) {
+                frame(x0, y0, w, h);
+            }
+            return;
+        }
+
+        data.resize((size_t) row_stride * h);
+        bmp_info_header.width = w;
+        bmp_info_header.height = h;
+        update_layout();
+    }
+
+    // BI_RLE8 / BI_RLE4 stream -> one index per byte, bottom-up rows of `width` bytes.
+    // Pixels the stream skips over (delta and early end of line) stay at index 0.
+    void decode_rle(const std::vector<uint8_t> &stream, bool rle4) {
+        uint32_t width = bmp_info_header.width;
+        uint32_t height = bmp_info_header.height;
+        data.assign((size_t) width * height, 0);
+
+        uint32_t x = 0, y = 0;
+        auto put = [&](uint8_t index) {
+            if (x < width && y < height) {
+                data[(size_t) y * width + x] = index;
+            }
+            ++x;
+        };
+
+        size_t i = 0;
+        while (i + 1 < stream.size() && y < height) {
+            uint8_t count = stream[i], value = stream[i + 1];
+            i += 2;
+
+            if (count > 0) {
+                for (uint32_t k = 0; k < count; ++k) {
+                    put(rle4 ? ((k % 2 == 0) ? value >> 4 : value & 0x0f) : value);
+                }
+            } else if (value == 0) {
+                x = 0;
+                ++y;
+            } else if (value == 1) {
+                break;
+            } else if (value == 2) {
+                if (i + 1 >= stream.size()) {
+                    break;
+                }
+                x += stream[i];
+                y += stream[i + 1];
+                i += 2;
+            } else {
+                size_t bytes = rle4 ? (value + 1) / 2 : value;
+                if (i + bytes > stream.size()) {
+                    break;
+                }
+                for (uint32_t k = 0; k < value; ++k) {
+                    put(rle4 ? ((k % 2 == 0) ? stream[i + k / 2] >> 4 : stream[i + k / 2] & 0x0f) : stream[i + k]);
+                }
+                i += (bytes + 1) & ~(size_t) 1;
+            }
         }
     }
 
-    void write_headers_and_data(std::ofstream &of) {
-        write_headers(of);
-        of.write((const char*) data.data(), data.size());
+    bool fits_rle4() const {
+        return pixel_format == PixelFormat::Indexed8 && palette.size() <= 16 &&
+                    std::all_of(data.begin(), data.end(), [](uint8_t pix) { return pix < 16; });
+    }
+
+    // Encodes rows bottom-up: runs of equal pixels as (count, value), everything
+    // else as absolute runs; each row ends with an end-of-line escape.
+    void encode_rle(std::vector<uint8_t> &stream, bool rle4) {
+        ImageView img = view();
+        stream.clear();
+
+        for (uint32_t y = 0; y < img.height; ++y) {
+            const uint8_t *row = img.row(y);
+            uint32_t x = 0;
+            while (x < img.width) {
+                uint32_t run = 1;
+                while (x + run < img.width && run < 255 && row[x + run] == row[x]) {
+                    ++run;
+                }
+                if (run >= 2) {
+                    stream.push_back(run);
+                    stream.push_back(rle4 ? (row[x] << 4) | row[x] : row[x]);
+                    x += run;
+                    continue;
+                }
+
+                // Absolute run up to the next three equal pixels
+                uint32_t len = 1;
+                while (x + len < img.width && len < 255 &&
+                        !(x + len + 2 < img.width && row[x + len] == row[x + len + 1] && row[x + len] == row[x + len + 2])) {
+                    ++len;
+                }
+                if (rle4 && len >= 3 && len % 2) {
+                    --len;      // Even absolute runs only, some decoders drop the last nibble of odd ones
+                }
+                if (len < 3) {
+                    for (uint32_t k = 0; k < len; ++k) {
+                        stream.push_back(1);
+                        stream.push_back(rle4 ? row[x + k] << 4 : row[x + k]);
+                    }
+                } else {
+                    stream.push_back(0);
+                    stream.push_back(len);
+                    size_t begin = stream.size();
+                    for (uint32_t k = 0; k < len; ++k) {
+                        if (!rle4) {
+                            stream.push_back(row[x + k]);
+                        } else if (k % 2 == 0) {
+                            stream.push_back(row[x + k] << 4);
+                        } else {
+                            stream.back() |= row[x + k];
+                        }
+                    }
+                    if ((stream.size() - begin) % 2) {
+                        stream.push_back(0);
+                    }
+                }
+                x += len;
+            }
+            stream.push_back(0);
+            stream.push_back(y + 1 == img.height ? 1 : 0);
+        }
+    }
+
+    static uint8_t *append_bytes(uint8_t *out, const void *src, size_t size) {
+        std::memcpy(out, src, size);
+        return out + size;
     }
 
     uint32_t make_stride_aligned(uint32_t align_stride) {
@@ -549,6 +1334,27 @@ private:
         return new_stride;
     }
 
+    // Header sizes and data offset for the current format, then file_size / size_image
+    void update_layout() {
+        if (bmp_info_header.bit_count == 32) {
+            bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+            file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+        } else {
+            bmp_info_header.size = sizeof(BMPInfoHeader);
+            file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + palette.size() * sizeof(uint32_t);
+        }
+        bmp_info_header.colors_used = (uint32_t) palette.size();
+        bmp_info_header.colors_important = 0;
+        update_file_size();
+    }
+
+    // Keeps file_size / size_image in sync with the current width, height and row_stride
+    void update_file_size() {
+        uint32_t file_stride = make_stride_aligned(4);
+        bmp_info_header.size_image = file_stride * (uint32_t) bmp_info_header.height;
+        file_header.file_size = file_header.offset_data + bmp_info_header.size_image;
+    }
+
     void check_color_header(BMPColorHeader &bmp_color_header) {
         BMPColorHeader expected_color_header;
         if(expected_color_header.red_mask != bmp_color_header.red_mask ||
@@ -563,4 +1369,4 @@ private:
     }
 };
 
-#endif // BMP_HEADER
\ No newline at end of file
+#endif // BMP_HEADER
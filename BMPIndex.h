@@ -0,0 +1,163 @@
+#ifndef BMP_INDEX_HEADER
+#define BMP_INDEX_HEADER
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "BMP.h"
+
+struct BMPIndexEntry {
+    std::string path;           // Relative to the indexed directory
+    std::time_t mtime{0};
+    uint64_t    size{0};
+    BMPInfo     info;
+};
+
+// Metadata of every .bmp file under a directory, built with BMP::probe() on
+// several threads and cached in `<dir>/.bmpindex`. refresh() only probes
+// files whose size or modification time differ from the cached entry.
+// Hidden directories (such as the result cache) are not scanned.
+class BMPIndex {
+public:
+    static constexpr const char *cache_name = ".bmpindex";
+
+    explicit BMPIndex(const std::string &dir) : dir(dir) {
+        load();
+    }
+
+    const std::vector<BMPIndexEntry> &entries() const {
+        return index;
+    }
+
+    // Rescans the directory; returns how many files had to be probed
+    size_t refresh(unsigned threads = std::thread::hardware_concurrency()) {
+        namespace fs = boost::filesystem;
+
+        std::map<std::string, BMPIndexEntry> cached;
+        for (BMPIndexEntry &entry : index) {
+            cached[entry.path] = entry;
+        }
+
+        std::vector<BMPIndexEntry> fresh;
+        std::vector<size_t> to_probe;
+        for (fs::recursive_directory_iterator it(dir), end; it != end; ++it) {
+            std::string name = it->path().filename().string();
+            if (fs::is_directory(it->status()) && name.size() > 1 && name[0] == '.') {
+                it.disable_recursion_pending();     // Hidden directories, like the `.bmpcache` of results
+                continue;
+            }
+            if (!fs::is_regular_file(it->status()) || !is_bmp_name(it->path())) {
+                continue;
+            }
+
+            BMPIndexEntry entry;
+            entry.path = fs::relative(it->path(), dir).generic_string();
+            entry.mtime = fs::last_write_time(it->path());
+            entry.size = fs::file_size(it->path());
+
+            auto found = cached.find(entry.path);
+            if (found != cached.end() && found->second.mtime == entry.mtime && found->second.size == entry.size) {
+                entry.info = found->second.info;
+            } else {
+                to_probe.push_back(fresh.size());
+            }
+            fresh.push_back(entry);
+        }
+
+        std::vector<char> failed(fresh.size(), 0);
+        std::atomic<size_t> next{0};
+        auto worker = [&]() {
+            for (size_t i = next++; i < to_probe.size(); i = next++) {
+                BMPIndexEntry &entry = fresh[to_probe[i]];
+                try {
+                    entry.info = BMP::probe((fs::path(dir) / entry.path).string().c_str());
+                }
+                catch (...) {
+                    failed[to_probe[i]] = 1;
+                }
+            }
+        };
+
+        threads = std::max(1u, std::min<unsigned>(threads, (unsigned) to_probe.size()));
+        std::vector<std::thread> pool;
+        for (unsigned t = 1; t < threads; ++t) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (std::thread &thread : pool) {
+            thread.join();
+        }
+
+        index.clear();
+        for (size_t i = 0; i < fresh.size(); ++i) {
+            if (!failed[i]) {
+                index.push_back(fresh[i]);
+            }
+        }
+        std::sort(index.begin(), index.end(), [](const BMPIndexEntry &a, const BMPIndexEntry &b) {
+            return a.path < b.path;
+        });
+
+        save();
+        return to_probe.size();
+    }
+
+private:
+    std::string                 dir;
+    std::vector<BMPIndexEntry>  index;
+
+    static bool is_bmp_name(const boost::filesystem::path &path) {
+        std::string ext = path.extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        return ext == ".bmp";
+    }
+
+    std::string cache_path() const {
+        return (boost::filesystem::path(dir) / cache_name).string();
+    }
+
+    // One tab separated line per file:
+    // path, mtime, size, width, height, bit count, compression, colors used, top-down
+    void load() {
+        std::ifstream inp(cache_path());
+        std::string line;
+        if (!std::getline(inp, line) || line != "# bmpindex 1") {
+            return;
+        }
+
+        while (std::getline(inp, line)) {
+            std::istringstream fields(line);
+            BMPIndexEntry entry;
+            if (std::getline(fields, entry.path, '\t') &&
+                    fields >> entry.mtime >> entry.size >> entry.info.width >> entry.info.height
+                            >> entry.info.bit_count >> entry.info.compression >> entry.info.colors_used
+                            >> entry.info.top_down) {
+                index.push_back(entry);
+            }
+        }
+    }
+
+    void save() const {
+        std::ofstream of(cache_path());
+        if (!of) {
+            return;
+        }
+
+        of << "# bmpindex 1\n";
+        for (const BMPIndexEntry &entry : index) {
+            of << entry.path << '\t' << entry.mtime << '\t' << entry.size << '\t'
+                << entry.info.width << '\t' << entry.info.height << '\t' << entry.info.bit_count << '\t'
+                << entry.info.compression << '\t' << entry.info.colors_used << '\t' << entry.info.top_down << '\n';
+        }
+    }
+};
+
+#endif // BMP_INDEX_HEADER
@@ -0,0 +1,271 @@
+#ifndef COLOR_SPACE_HEADER
+#define COLOR_SPACE_HEADER
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "ImageView.h"
+
+// Fixed-point color spaces. Pixels are BGR(A) bytes as stored in BMP files.
+// Hue is measured in 1/256 of a 60 degree sector: [0, hue_steps).
+
+enum class LumaStandard : uint8_t {
+    Rec601,     // Y = 0.299 R + 0.587 G + 0.114 B
+    Rec709      // Y = 0.2126 R + 0.7152 G + 0.0722 B
+};
+
+static constexpr int32_t hue_steps = 6 * 256;
+
+struct HSV {
+    uint16_t h{0};
+    uint8_t s{0};
+    uint8_t v{0};
+};
+
+struct HSL {
+    uint16_t h{0};
+    uint8_t s{0};
+    uint8_t l{0};
+};
+
+inline void luma_weights(LumaStandard standard, double &kb, double &kr) {
+    if (standard == LumaStandard::Rec709) {
+        kb = 0.0722;
+        kr = 0.2126;
+    } else {
+        kb = 0.114;
+        kr = 0.299;
+    }
+}
+
+inline uint8_t clamp_byte(int32_t value) {
+    return (uint8_t) std::min(255, std::max(0, value));
+}
+
+// Hue of the color with the given max, min and chroma = max - min
+inline uint16_t hue_of(const uint8_t *bgr, int32_t max, int32_t chroma) {
+    if (!chroma) {
+        return 0;
+    }
+    int32_t b = bgr[0], g = bgr[1], r = bgr[2];
+    int32_t sector, diff;
+    if (max == r) {
+        sector = 0;
+        diff = g - b;
+    } else if (max == g) {
+        sector = 512;
+        diff = b - r;
+    } else {
+        sector = 1024;
+        diff = r - g;
+    }
+    // Rounded to the nearest step (diff may be negative), so hue_to_bgr() gets the middle channel back
+    int32_t h = sector + (512 * diff + chroma + 512 * chroma) / (2 * chroma) - 256;
+    return (uint16_t) (h < 0 ? h + hue_steps : h);
+}
+
+// Chroma spread over the sector of `h`, then lifted by m
+inline void hue_to_bgr(uint16_t h, int32_t chroma, int32_t m, uint8_t *bgr) {
+    int32_t sector = (h / 256) % 6, frac = h % 256;
+    int32_t x = (chroma * (sector & 1 ? 256 - frac : frac) + 128) / 256;
+    int32_t r = 0, g = 0, b = 0;
+    switch (sector) {
+        case 0: r = chroma; g = x; break;
+        case 1: r = x; g = chroma; break;
+        case 2: g = chroma; b = x; break;
+        case 3: g = x; b = chroma; break;
+        case 4: r = x; b = chroma; break;
+        default: r = chroma; b = x; break;
+    }
+    bgr[0] = clamp_byte(b + m);
+    bgr[1] = clamp_byte(g + m);
+    bgr[2] = clamp_byte(r + m);
+}
+
+inline HSV bgr_to_hsv(const uint8_t *bgr) {
+    int32_t max = std::max(bgr[0], std::max(bgr[1], bgr[2]));
+    int32_t min = std::min(bgr[0], std::min(bgr[1], bgr[2]));
+    HSV out;
+    out.h = hue_of(bgr, max, max - min);
+    out.s = max ? (255 * (max - min) + max / 2) / max : 0;
+    out.v = max;
+    return out;
+}
+
+inline void hsv_to_bgr(HSV color, uint8_t *bgr) {
+    int32_t chroma = (color.v * color.s + 127) / 255;
+    hue_to_bgr(color.h, chroma, color.v - chroma, bgr);
+}
+
+inline HSL bgr_to_hsl(const uint8_t *bgr) {
+    int32_t max = std::max(bgr[0], std::max(bgr[1], bgr[2]));
+    int32_t min = std::min(bgr[0], std::min(bgr[1], bgr[2]));
+    int32_t span = 255 - std::abs(max + min - 255);
+    HSL out;
+    out.h = hue_of(bgr, max, max - min);
+    out.s = span ? (255 * (max - min) + span / 2) / span : 0;
+    out.l = (max + min + 1) / 2;
+    return out;
+}
+
+inline void hsl_to_bgr(HSL color, uint8_t *bgr) {
+    // l rounds max + min up. max + min and the chroma max - min are both odd or both even, so a
+    // first guess of the chroma mostly recovers the sum; 8-bit l and s still lose it for some colors (+-1)
+    int32_t chroma = ((255 - std::abs(2 * color.l - 255)) * color.s + 127) / 255;
+    int32_t sum = 2 * color.l - (chroma & 1);
+    chroma = ((255 - std::abs(sum - 255)) * color.s + 127) / 255;
+    sum = std::max(chroma, 2 * color.l - (chroma & 1));
+    hue_to_bgr(color.h, chroma, (sum - chroma) / 2, bgr);
+}
+
+inline uint32_t color_distance2(const uint8_t *bgr, uint8_t B, uint8_t G, uint8_t R) {
+    int32_t db = bgr[0] - B, dg = bgr[1] - G, dr = bgr[2] - R;
+    return db * db + dg * dg + dr * dr;
+}
+
+enum class ColorModel : uint8_t {
+    YCbCr,      // Keeps the luma: the chroma is scaled and rotated in the CbCr plane
+    HSV,        // Keeps the value (max channel): HSV saturation is scaled, the hue rotated
+    HSL         // Keeps the lightness: HSL saturation is scaled, the hue rotated
+};
+
+struct ColorAdjust {
+    ColorModel      model{ColorModel::YCbCr};
+    LumaStandard    standard{LumaStandard::Rec601};     // Luma of the YCbCr model
+    double          saturation{1.0};    // Chroma scale: 0 is luma grey, 1 keeps the colors, up to 4
+    double          hue{0.0};           // Hue rotation in degrees
+    double          vibrance{0.0};      // [-1, 1]: extra saturation for the dull colors only
+};
+
+// All of ColorAdjust as one pass over the pixels. In the YCbCr model the luma
+// is kept and the chroma (the pixel minus its luma, rotated in the CbCr plane
+// for the hue) is scaled per pixel. Converting to YCbCr, rotating and
+// converting back are linear, so they are folded into one 3x3 matrix in
+// 10-bit fixed point and every pixel costs a few integer multiply-adds in a
+// branch-free loop. The HSV and HSL models are not linear: every pixel is
+// converted, adjusted and converted back in the same loop.
+class ColorTransform {
+public:
+    explicit ColorTransform(const ColorAdjust &adjust) : model(adjust.model) {
+        double kb, kr;
+        luma_weights(adjust.standard, kb, kr);
+        luma[0] = std::lround(kb * one);
+        luma[2] = std::lround(kr * one);
+        luma[1] = one - luma[0] - luma[2];
+        kb = luma[0] / (double) one;    // The rounded weights, so the identity adjustment is exact
+        kr = luma[2] / (double) one;
+
+        const double pi = std::acos(-1.0);
+        double cos_h = std::cos(adjust.hue * pi / 180), sin_h = std::sin(adjust.hue * pi / 180);
+        for (int j = 0; j < 3; ++j) {
+            // Chroma part of the output for the unit input in channel j
+            double y = luma[j] / (double) one;
+            double cb = ((j == 0) - y) / (2 * (1 - kb));
+            double cr = ((j == 2) - y) / (2 * (1 - kr));
+            double db = 2 * (1 - kb) * (cos_h * cb - sin_h * cr);
+            double dr = 2 * (1 - kr) * (sin_h * cb + cos_h * cr);
+            double dg = -(kb * db + kr * dr) / (1 - kb - kr);
+            chroma[0][j] = std::lround(db * one);
+            chroma[1][j] = std::lround(dg * one);
+            chroma[2][j] = std::lround(dr * one);
+        }
+        saturation = std::lround(std::min(4.0, std::max(0.0, adjust.saturation)) * 256);
+        vibrance = std::lround(std::min(1.0, std::max(-1.0, adjust.vibrance)) * 256);
+        hue_shift = (int32_t) (std::lround(adjust.hue / 60 * 256) % hue_steps);
+        hue_shift += hue_shift < 0 ? hue_steps : 0;
+    }
+
+    void apply(ImageView img) const {
+        if (img.channels() == 1) {
+            return;     // Grey pixels have no chroma to change
+        }
+        if (model != ColorModel::YCbCr && saturation == 256 && !vibrance && !hue_shift) {
+            return;     // Not a no-op otherwise: HSL does not give every color back exactly
+        }
+        bool bgr = img.channels() == 3;
+        switch (model) {
+            case ColorModel::YCbCr:
+                bgr ? apply_rows<3>(img) : apply_rows<4>(img);
+                break;
+            case ColorModel::HSV:
+                bgr ? apply_model_rows<3, HSV>(img) : apply_model_rows<4, HSV>(img);
+                break;
+            case ColorModel::HSL:
+                bgr ? apply_model_rows<3, HSL>(img) : apply_model_rows<4, HSL>(img);
+                break;
+        }
+    }
+
+private:
+    static constexpr int32_t one = 1 << 10;
+
+    ColorModel model;
+    int32_t hue_shift;      // [0, hue_steps)
+    int32_t luma[3];
+    int32_t chroma[3][3];
+    int32_t saturation;     // 8 fractional bits
+    int32_t vibrance;       // 8 fractional bits
+
+    template <uint32_t channels>
+    void apply_rows(ImageView img) const {
+        // Local copies: stores through uint8_t pointers would otherwise force reloading the members
+        const int32_t lb = luma[0], lg = luma[1], lr = luma[2];
+        const int32_t bb = chroma[0][0], bg = chroma[0][1], br = chroma[0][2];
+        const int32_t gb = chroma[1][0], gg = chroma[1][1], gr = chroma[1][2];
+        const int32_t rb = chroma[2][0], rg = chroma[2][1], rr = chroma[2][2];
+        const int32_t sat = saturation, vib = vibrance;
+
+        for (uint32_t y = 0; y < img.height; ++y) {
+            uint8_t *pix = img.row(y);
+            for (uint32_t x = 0; x < img.width; ++x, pix += channels) {
+                int32_t b = pix[0], g = pix[1], r = pix[2];
+                int32_t spread = std::max(b, std::max(g, r)) - std::min(b, std::min(g, r));
+                int32_t scale = sat + ((sat * vib * (255 - spread)) >> 16);
+                scale = std::min(std::max(scale, 0), 4 * 256);
+
+                int32_t base = lb * b + lg * g + lr * r + one / 2;
+                pix[0] = clamp_byte((base + (((bb * b + bg * g + br * r) * scale) >> 8)) >> 10);
+                pix[1] = clamp_byte((base + (((gb * b + gg * g + gr * r) * scale) >> 8)) >> 10);
+                pix[2] = clamp_byte((base + (((rb * b + rg * g + rr * r) * scale) >> 8)) >> 10);
+            }
+        }
+    }
+
+    static void to_model(const uint8_t *bgr, HSV &color) {
+        color = bgr_to_hsv(bgr);
+    }
+
+    static void to_model(const uint8_t *bgr, HSL &color) {
+        color = bgr_to_hsl(bgr);
+    }
+
+    static void from_model(HSV color, uint8_t *bgr) {
+        hsv_to_bgr(color, bgr);
+    }
+
+    static void from_model(HSL color, uint8_t *bgr) {
+        hsl_to_bgr(color, bgr);
+    }
+
+    // Vibrance scales the saturation more for the dull colors, by the model's own saturation
+    template <uint32_t channels, typename Color>
+    void apply_model_rows(ImageView img) const {
+        const int32_t sat = saturation, vib = vibrance, shift = hue_shift;
+
+        for (uint32_t y = 0; y < img.height; ++y) {
+            uint8_t *pix = img.row(y);
+            for (uint32_t x = 0; x < img.width; ++x, pix += channels) {
+                Color color;
+                to_model(pix, color);
+                int32_t scale = sat + ((sat * vib * (255 - color.s)) >> 16);
+                scale = std::min(std::max(scale, 0), 4 * 256);
+
+                color.h = (uint16_t) ((color.h + shift) % hue_steps);
+                color.s = clamp_byte((color.s * scale + 128) >> 8);
+                from_model(color, pix);
+            }
+        }
+    }
+};
+
+#endif // COLOR_SPACE_HEADER
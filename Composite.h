@@ -0,0 +1,326 @@
+#ifndef COMPOSITE_HEADER
+#define COMPOSITE_HEADER
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ImageView.h"
+#include "Parallel.h"
+
+enum class BlendMode : uint8_t {
+    Over,       // Porter-Duff source over destination
+    Multiply,   // Darkens: white in the source keeps the destination
+    Screen      // Lightens: black in the source keeps the destination
+};
+
+// x * y / 255, rounded, for bytes
+inline uint32_t mul255(uint32_t x, uint32_t y) {
+    uint32_t t = x * y + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+// An image prepared for compositing: premultiplied BGRA rows (row 0 at the
+// bottom, like ImageView) and, for each row, the spans of pixels that are not
+// fully transparent, so drawing a mostly transparent watermark only touches
+// the destination pixels it covers. Build it once and draw() it on any
+// number of images. Premultiplied colors are kept unrounded (color * alpha,
+// 16 bits), so faint pixels keep their color and every blend rounds once.
+class Layer {
+public:
+    // `palette` (BGRX quads, `palette_size` of them) is needed for Indexed8 sources only;
+    // indices past its end are black, like in BMP::to_bgr24().
+    // A 32-bit source whose alpha is zero everywhere has no alpha channel in use and counts as opaque.
+    explicit Layer(ImageView src, const uint32_t *palette = nullptr, size_t palette_size = 0)
+            : width(src.width), height(src.height) {
+        if (src.format == PixelFormat::Indexed8 && !palette_size) {
+            throw std::runtime_error("The layer needs the palette of the image!");
+        }
+
+        pixels.resize((size_t) width * height);
+        spans.resize(height);
+        uint32_t channels = src.channels();
+        bool has_alpha = false;
+        for (uint32_t y = 0; y < height && channels == 4 && !has_alpha; ++y) {
+            for (uint32_t x = 0; x < width && !has_alpha; ++x) {
+                has_alpha = src.pixel(x, y)[3] != 0;
+            }
+        }
+
+        for (uint32_t y = 0; y < height; ++y) {
+            const uint8_t *pix = src.row(y);
+            Pixel *out = pixels.data() + (size_t) width * y;
+            for (uint32_t x = 0; x < width; ++x, pix += channels) {
+                uint32_t b, g, r, a = 255;
+                if (src.format == PixelFormat::Indexed8) {
+                    uint32_t color = pix[0] < palette_size ? palette[pix[0]] : 0;
+                    b = color & 0xff;
+                    g = (color >> 8) & 0xff;
+                    r = (color >> 16) & 0xff;
+                } else if (channels == 1) {
+                    b = g = r = pix[0];
+                } else {
+                    b = pix[0];
+                    g = pix[1];
+                    r = pix[2];
+                    if (has_alpha) {
+                        a = pix[3];
+                    }
+                }
+                out[x] = Pixel{ { (uint16_t) (b * a), (uint16_t) (g * a), (uint16_t) (r * a) }, (uint16_t) a };
+            }
+
+            for (uint32_t x = 0; x < width;) {
+                for (; x < width && !out[x].alpha; ++x) {
+                }
+                uint32_t begin = x;
+                for (; x < width && out[x].alpha; ++x) {
+                }
+                if (begin < x) {
+                    spans[y].push_back({ begin, x });
+                }
+            }
+        }
+    }
+
+    uint32_t get_width() const {
+        return width;
+    }
+
+    uint32_t get_height() const {
+        return height;
+    }
+
+    // Composites the layer onto `dst` (BGR24 or straight alpha BGRA32) with its
+    // bottom-left corner at (x0, y0); the parts outside `dst` are clipped.
+    // `opacity` scales the alpha of the whole layer. Rows are split between threads.
+    void draw(ImageView dst, int32_t x0, int32_t y0, BlendMode mode = BlendMode::Over, uint8_t opacity = 255,
+              unsigned threads = std::thread::hardware_concurrency()) const {
+        if (dst.channels() < 3) {
+            throw std::runtime_error("Layers can only be drawn on 24 and 32-bit images!");
+        }
+
+        int64_t left = std::max<int64_t>(0, -(int64_t) x0), right = std::min<int64_t>(width, (int64_t) dst.width - x0);
+        int64_t bottom = std::max<int64_t>(0, -(int64_t) y0), top = std::min<int64_t>(height, (int64_t) dst.height - y0);
+        if (left >= right || bottom >= top || !opacity) {
+            return;
+        }
+
+        Clip clip{ dst, x0, y0, (uint32_t) left, (uint32_t) right, (uint32_t) bottom, opacity };
+        run_parallel(top - bottom, threads, [&](size_t begin, size_t end) {
+            for (size_t row = begin; row < end; ++row) {
+                draw_row(clip, (uint32_t) (bottom + row), mode);
+            }
+        });
+    }
+
+private:
+    struct Pixel {
+        uint16_t color[3];  // B, G, R times alpha
+        uint16_t alpha;
+    };
+
+    struct Span {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    struct Clip {
+        ImageView   dst;
+        int32_t     x0;
+        int32_t     y0;
+        uint32_t    left;       // Layer columns [left, right) are inside dst
+        uint32_t    right;
+        uint32_t    bottom;
+        uint8_t     opacity;
+    };
+
+    uint32_t                            width;
+    uint32_t                            height;
+    std::vector<Pixel>                  pixels;
+    std::vector<std::vector<Span>>      spans;
+
+    void draw_row(const Clip &clip, uint32_t y, BlendMode mode) const {
+        bool opaque = clip.dst.channels() == 3;
+        switch (mode) {
+            case BlendMode::Over:
+                opaque ? draw_spans<BlendMode::Over, 3>(clip, y) : draw_spans<BlendMode::Over, 4>(clip, y);
+                break;
+            case BlendMode::Multiply:
+                opaque ? draw_spans<BlendMode::Multiply, 3>(clip, y) : draw_spans<BlendMode::Multiply, 4>(clip, y);
+                break;
+            case BlendMode::Screen:
+                opaque ? draw_spans<BlendMode::Screen, 3>(clip, y) : draw_spans<BlendMode::Screen, 4>(clip, y);
+                break;
+        }
+    }
+
+    // Opacity scales the premultiplied colors by opacity / 255 in 16-bit fixed point (the same
+    // in the SIMD and the scalar code, so both round alike) and the alpha exactly
+    static uint32_t opacity_scale(uint32_t opacity) {
+        return (opacity * 65536 + 127) / 255;
+    }
+
+    template <BlendMode mode, uint32_t channels>
+    void draw_spans(const Clip &clip, uint32_t y) const {
+        const Pixel *src_row = pixels.data() + (size_t) width * y;
+        uint8_t *dst_row = clip.dst.row(y + clip.y0);
+        const uint32_t opacity = clip.opacity, scale = opacity_scale(opacity);
+
+        for (const Span &span : spans[y]) {
+            uint32_t begin = std::max(span.begin, clip.left), end = std::min(span.end, clip.right);
+            for (uint32_t x = begin; x < end;) {
+                uint32_t stop = end;
+#ifdef __SSE2__
+                if (mode == BlendMode::Over) {
+                    x = draw_over_simd<channels>(src_row, dst_row, clip.x0, x, end, opacity);
+                    stop = std::min(end, x + 4);    // Past translucent destination pixels, then SIMD again
+                }
+#endif
+                for (; x < stop; ++x) {
+                    const Pixel &src = src_row[x];
+                    uint32_t sa = src.alpha;
+                    uint32_t sc[3] = { src.color[0], src.color[1], src.color[2] };
+                    if (opacity != 255) {
+                        sa = mul255(sa, opacity);
+                        for (int k = 0; k < 3; ++k) {
+                            sc[k] = (sc[k] * scale) >> 16;
+                        }
+                    }
+                    blend<mode, channels>(dst_row + channels * (uint32_t) ((int32_t) x + clip.x0), sc, sa);
+                }
+            }
+        }
+    }
+
+    // round(t / 255) for t <= 65025 + 255 (premultiplied sums), clamped to a byte
+    static uint32_t div255(uint32_t t) {
+        t += 128;
+        return std::min<uint32_t>((t + (t >> 8)) >> 8, 255);
+    }
+
+    // Premultiplied blending with source colors `sc` in 1/65025 units (color * alpha).
+    // A BGR24 destination, or a BGRA32 pixel with alpha 255, is opaque and needs no
+    // division; a translucent BGRA32 pixel is stored with straight alpha and gets divided
+    // by the result alpha (through reciprocals()) at the end.
+    template <BlendMode mode, uint32_t channels>
+    static void blend(uint8_t *dst, const uint32_t *sc, uint32_t sa) {
+        if (channels == 3 || dst[3] == 255) {
+            for (int k = 0; k < 3; ++k) {
+                uint32_t dc = dst[k];
+                if (mode == BlendMode::Over) {
+                    dst[k] = (uint8_t) div255(sc[k] + dc * (255 - sa));
+                } else if (mode == BlendMode::Multiply) {
+                    dst[k] = (uint8_t) ((dc * (sc[k] + 255 * (255 - sa)) + 32512) / 65025);
+                } else {
+                    dst[k] = (uint8_t) std::min<uint32_t>((255 * sc[k] + 65025 * dc - sc[k] * dc + 32512) / 65025, 255);
+                }
+            }
+            return;
+        }
+
+        uint32_t da = dst[3];
+        uint32_t out_a = 255 * (sa + da) - sa * da;     // 1/65025 units
+        if (!out_a) {
+            return;
+        }
+        uint64_t reciprocal = reciprocals()[out_a];
+        for (int k = 0; k < 3; ++k) {
+            uint64_t s = sc[k], d = dst[k] * da, out;
+            if (mode == BlendMode::Over) {
+                out = s + d * (255 - sa) / 255;
+            } else if (mode == BlendMode::Multiply) {
+                out = (s * d + 32512) / 65025 + s * (255 - da) / 255 + d * (255 - sa) / 255;
+            } else {
+                out = s + d - (s * d + 32512) / 65025;
+            }
+            dst[k] = (uint8_t) std::min<uint64_t>(((out * 255 + out_a / 2) * reciprocal) >> 40, 255);
+        }
+        dst[3] = (uint8_t) ((out_a + 127) / 255);
+    }
+
+    // ceil(2^40 / d) for every result alpha d in 1/65025 units: n * r >> 40 == n / d for every
+    // n < 2^24, as nonzero results are at least 255 (one of the alphas is 1 or more)
+    static const std::vector<uint64_t> &reciprocals() {
+        static const std::vector<uint64_t> table = [] {
+            std::vector<uint64_t> r(65026, 0);
+            for (uint64_t d = 1; d < r.size(); ++d) {
+                r[d] = ((uint64_t) 1 << 40) / d + 1;
+            }
+            return r;
+        }();
+        return table;
+    }
+
+#ifdef __SSE2__
+    // Over onto opaque destination pixels, 4 at a time with 8 channels (2 source pixels) per
+    // register: t = sc + dc * (255 - sa) in 16-bit lanes and div255(t) without a division.
+    // BGRA32 pixels are taken only when all 4 are opaque. `dst_row` is the
+    // destination row and layer column x lands on column x + x0. Returns the first column left for the scalar code.
+    template <uint32_t channels>
+    static uint32_t draw_over_simd(const Pixel *src, uint8_t *dst_row, int32_t x0, uint32_t x, uint32_t end,
+                                   uint32_t opacity) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i alpha_bytes = _mm_set1_epi32((int) 0xff000000);
+        for (; channels == 4 && x + 4 <= end; x += 4) {
+            uint8_t *out = dst_row + 4 * (uint32_t) ((int32_t) x + x0);
+            __m128i d = _mm_loadu_si128((const __m128i*) out);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(d, alpha_bytes), alpha_bytes)) != 0xffff) {
+                break;
+            }
+            __m128i lo = over_lanes(_mm_loadu_si128((const __m128i*) (src + x)), _mm_unpacklo_epi8(d, zero), opacity);
+            __m128i hi = over_lanes(_mm_loadu_si128((const __m128i*) (src + x + 2)), _mm_unpackhi_epi8(d, zero), opacity);
+            _mm_storeu_si128((__m128i*) out, _mm_or_si128(_mm_packus_epi16(lo, hi), alpha_bytes));
+        }
+
+        const __m128i low_pixel = _mm_set1_epi64x(0xffffff), high_pixel = _mm_set1_epi64x(0xffffff000000);
+        const __m128i first_half = _mm_setr_epi32(-1, 0xffff, 0, 0), second_half = _mm_setr_epi32(0, (int) 0xffff0000, -1, 0);
+        for (; channels == 3 && x + 4 <= end; x += 4) {
+            // 12 bytes, loaded and stored as 8 + 4 so that no load overlaps the previous store;
+            // each pair of pixels is spread to the lanes b0 g0 r0 _ b1 g1 r1 _
+            uint8_t *out = dst_row + 3 * (uint32_t) ((int32_t) x + x0);
+            uint32_t last;
+            std::memcpy(&last, out + 8, 4);
+            __m128i d = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*) out), _mm_cvtsi32_si128((int) last));
+            __m128i d01 = _mm_unpacklo_epi8(d, zero), d23 = _mm_unpacklo_epi8(_mm_srli_si128(d, 6), zero);
+            __m128i r01 = over_lanes(_mm_loadu_si128((const __m128i*) (src + x)),
+                                     _mm_unpacklo_epi64(d01, _mm_srli_si128(d01, 6)), opacity);
+            __m128i r23 = over_lanes(_mm_loadu_si128((const __m128i*) (src + x + 2)),
+                                     _mm_unpacklo_epi64(d23, _mm_srli_si128(d23, 6)), opacity);
+            // BGRX dwords back to 12 packed bytes: 6 in each 64-bit half, then the halves joined
+            __m128i q = _mm_packus_epi16(r01, r23);
+            q = _mm_or_si128(_mm_and_si128(q, low_pixel), _mm_and_si128(_mm_srli_epi64(q, 8), high_pixel));
+            q = _mm_or_si128(_mm_and_si128(q, first_half), _mm_and_si128(_mm_srli_si128(q, 2), second_half));
+            _mm_storel_epi64((__m128i*) out, q);
+            last = (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(q, 8));
+            std::memcpy(out + 8, &last, 4);
+        }
+        return x;
+    }
+
+    // Two pixels: source lanes (c0, c1, c2, alpha) and destination lanes (d0, d1, d2, _)
+    static __m128i over_lanes(__m128i s, __m128i d, uint32_t opacity) {
+        __m128i sa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+        if (opacity != 255) {
+            __m128i op = _mm_set1_epi16((short) opacity);
+            s = _mm_mulhi_epu16(s, _mm_set1_epi16((short) opacity_scale(opacity)));
+            sa = div255_lanes(_mm_mullo_epi16(sa, op));
+        }
+        __m128i t = _mm_adds_epu16(s, _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), sa)));
+        return div255_lanes(t);
+    }
+
+    // div255() of unsigned 16-bit lanes; sums past 65535 saturate to 255
+    static __m128i div255_lanes(__m128i t) {
+        t = _mm_adds_epu16(t, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_adds_epu16(t, _mm_srli_epi16(t, 8)), 8);
+    }
+#endif
+};
+
+#endif // COMPOSITE_HEADER
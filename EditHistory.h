@@ -0,0 +1,295 @@
+#ifndef EDIT_HISTORY_HEADER
+#define EDIT_HISTORY_HEADER
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "BMP.h"
+
+// Undo/redo states of one BMP. The pixel data of every state is cut into
+// tiles of tile_size x tile_size pixels held by shared pointers. An edit is
+// announced with the rectangle it changes: prepare() before it, commit()
+// after it. Only the tiles in that rectangle are looked at and copied, the
+// rest are shared with the previous state, so a step costs time and memory
+// in proportion to what it changed, and undo()/redo() only write back the
+// tiles that differ between two states. The tiles of the image given to
+// reset() stay in the image itself until an edit is about to change them.
+class EditHistory {
+public:
+    static constexpr uint32_t tile_size = 128;
+
+    // Pixels (x0, y0, width, height) in the coordinates of BMP::fill_region(), row 0 at the bottom
+    struct Rect {
+        uint32_t x0;
+        uint32_t y0;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    explicit EditHistory(size_t max_states = 64) : max_states(std::max<size_t>(max_states, 2)) {
+    }
+
+    static Rect whole(const BMP &bmp) {
+        return Rect{ 0, 0, (uint32_t) bmp.bmp_info_header.width, (uint32_t) std::abs(bmp.bmp_info_header.height) };
+    }
+
+    // Forgets everything and starts from the current image; nothing is copied yet
+    void reset(const BMP &bmp) {
+        states.clear();
+        states.push_back(describe(bmp));
+        states.back().tiles.resize(tile_count(states.back()));
+        current = 0;
+    }
+
+    // To be called before `rect` of the image changes; an edit that changes the size
+    // or the format of the image changes all of it. The tiles there that are still only
+    // held by the image given to reset() are copied out.
+    void prepare(const BMP &bmp, const Rect &rect) {
+        if (states.empty()) {
+            return;
+        }
+        State &state = states[current];
+        for_each_tile(state, rect, [&](uint32_t index, uint32_t y, uint32_t rows, uint32_t offset, uint32_t bytes) {
+            if (state.tiles[index]) {
+                return;
+            }
+            std::shared_ptr<const Tile> tile = copy_tile(bmp, state, y, rows, offset, bytes);
+            for (State &other : states) {
+                if (index < other.tiles.size() && !other.tiles[index]) {
+                    other.tiles[index] = tile;
+                }
+            }
+        });
+    }
+
+    void prepare(const BMP &bmp) {
+        prepare(bmp, whole(bmp));
+    }
+
+    // Records the image after an edit of `rect`, prepared before; the states that
+    // could be redone are dropped. Tiles outside `rect` are shared with the previous state.
+    void commit(const BMP &bmp, const Rect &rect) {
+        if (states.empty()) {
+            reset(bmp);
+            return;
+        }
+        states.erase(states.begin() + current + 1, states.end());
+        states.push_back(capture(bmp, states.back(), rect));
+        if (states.size() > max_states) {
+            states.pop_front();
+        }
+        current = states.size() - 1;
+    }
+
+    void commit(const BMP &bmp) {
+        commit(bmp, whole(bmp));
+    }
+
+    // Names the current state, so undo()/redo() can jump to it
+    void checkpoint(const std::string &name) {
+        if (!states.empty()) {
+            states[current].name = name;
+        }
+    }
+
+    // Steps back once, or to the nearest earlier state called `name`
+    bool undo(BMP &bmp, const std::string &name = "") {
+        for (size_t i = current; i-- > 0;) {
+            if (name.empty() || states[i].name == name) {
+                restore(bmp, i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool redo(BMP &bmp, const std::string &name = "") {
+        for (size_t i = current + 1; i < states.size(); ++i) {
+            if (name.empty() || states[i].name == name) {
+                restore(bmp, i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t undo_steps() const {
+        return current;
+    }
+
+    size_t redo_steps() const {
+        return states.empty() ? 0 : states.size() - current - 1;
+    }
+
+    // Pixel bytes held by all states, every shared tile counted once
+    size_t memory_bytes() const {
+        std::unordered_set<const Tile*> seen;
+        size_t bytes = 0;
+        for (const State &state : states) {
+            for (const std::shared_ptr<const Tile> &tile : state.tiles) {
+                if (tile && seen.insert(tile.get()).second) {
+                    bytes += tile->size();
+                }
+            }
+        }
+        return bytes;
+    }
+
+private:
+    using Tile = std::vector<uint8_t>;
+
+    struct State {
+        BMPFileHeader                       file_header;
+        BMPInfoHeader                       info_header;
+        BMPColorHeader                      color_header;
+        std::vector<uint32_t>               palette;
+        bool                                top_down{false};
+        PixelFormat                         format{PixelFormat::BGR24};
+        uint32_t                            row_stride{0};
+        uint32_t                            rows{0};
+        std::vector<std::shared_ptr<const Tile>> tiles;     // Row-major, tiles_x() per tile row; null while
+                                                            // still only in the image given to reset()
+        std::string                         name;
+
+        uint32_t tile_bytes() const {
+            return tile_size * format_channels(format);
+        }
+
+        uint32_t tiles_x() const {
+            return (row_stride + tile_bytes() - 1) / tile_bytes();
+        }
+
+        bool same_layout(const State &other) const {
+            return row_stride == other.row_stride && rows == other.rows && format == other.format;
+        }
+    };
+
+    size_t              max_states;
+    std::deque<State>   states;
+    size_t              current{0};
+
+    // Calls fn(tile index, first row, row count, byte offset in a row, bytes per row) for every
+    // tile that overlaps `rect`; rows are counted in storage order, like in BMP::data
+    template <typename Fn>
+    static void for_each_tile(const State &state, const Rect &rect, Fn fn) {
+        uint32_t width = state.info_header.width;
+        uint32_t x1 = std::min<uint64_t>((uint64_t) rect.x0 + rect.width, width);
+        uint32_t y1 = std::min<uint64_t>((uint64_t) rect.y0 + rect.height, state.rows);
+        if (!state.row_stride || rect.x0 >= x1 || rect.y0 >= y1) {
+            return;
+        }
+        uint32_t first_row = state.top_down ? state.rows - y1 : rect.y0;
+        uint32_t last_row = state.top_down ? state.rows - 1 - rect.y0 : y1 - 1;
+        uint32_t tiles_x = state.tiles_x();
+        for (uint32_t ty = first_row / tile_size; ty <= last_row / tile_size; ++ty) {
+            uint32_t y = ty * tile_size;
+            for (uint32_t tx = rect.x0 / tile_size; tx <= (x1 - 1) / tile_size; ++tx) {
+                uint32_t offset = tx * state.tile_bytes();
+                fn(ty * tiles_x + tx, y, std::min(tile_size, state.rows - y), offset,
+                   std::min(state.tile_bytes(), state.row_stride - offset));
+            }
+        }
+    }
+
+    static size_t tile_count(const State &state) {
+        return (size_t) state.tiles_x() * ((state.rows + tile_size - 1) / tile_size);
+    }
+
+    // Everything but the pixels
+    static State describe(const BMP &bmp) {
+        State state;
+        state.file_header = bmp.file_header;
+        state.info_header = bmp.bmp_info_header;
+        state.color_header = bmp.bmp_color_header;
+        state.palette = bmp.palette;
+        state.top_down = bmp.top_down;
+        state.format = bmp.pixel_format;
+        state.row_stride = bmp.row_stride;
+        state.rows = bmp.row_stride ? bmp.data.size() / bmp.row_stride : 0;
+        return state;
+    }
+
+    static std::shared_ptr<const Tile> copy_tile(const BMP &bmp, const State &state, uint32_t y, uint32_t rows,
+                                                 uint32_t offset, uint32_t bytes) {
+        const uint8_t *src = bmp.data.data() + (size_t) state.row_stride * y + offset;
+        std::shared_ptr<Tile> tile = std::make_shared<Tile>((size_t) rows * bytes);
+        for (uint32_t row = 0; row < rows; ++row) {
+            std::memcpy(tile->data() + (size_t) bytes * row, src + (size_t) state.row_stride * row, bytes);
+        }
+        return tile;
+    }
+
+    // A new layout is captured whole; otherwise only the tiles in `rect` that differ from `previous` are copied
+    static State capture(const BMP &bmp, const State &previous, Rect rect) {
+        State state = describe(bmp);
+        if (state.same_layout(previous)) {
+            state.tiles = previous.tiles;
+        } else {
+            if (std::find(previous.tiles.begin(), previous.tiles.end(), nullptr) != previous.tiles.end()) {
+                throw std::runtime_error("The whole image must be prepared before its size or format changes!");
+            }
+            state.tiles.resize(tile_count(state));
+            rect = whole(bmp);
+        }
+
+        for_each_tile(state, rect, [&](uint32_t index, uint32_t y, uint32_t rows, uint32_t offset, uint32_t bytes) {
+            const std::shared_ptr<const Tile> &old = state.tiles[index];
+            if (old && same_pixels(*old, bmp.data.data() + (size_t) state.row_stride * y + offset,
+                                   state.row_stride, rows, bytes)) {
+                return;
+            }
+            if (!old && state.same_layout(previous)) {
+                throw std::runtime_error("The changed region must be prepared before the change!");
+            }
+            state.tiles[index] = copy_tile(bmp, state, y, rows, offset, bytes);
+        });
+        return state;
+    }
+
+    static bool same_pixels(const Tile &tile, const uint8_t *src, uint32_t stride, uint32_t rows, uint32_t bytes) {
+        for (uint32_t row = 0; row < rows; ++row) {
+            if (std::memcmp(tile.data() + (size_t) bytes * row, src + (size_t) stride * row, bytes)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // `bmp` holds states[current]: only the tiles that differ from the target are written
+    void restore(BMP &bmp, size_t target) {
+        const State &from = states[current];
+        const State &to = states[target];
+        bool same_layout = to.same_layout(from);
+
+        bmp.file_header = to.file_header;
+        bmp.bmp_info_header = to.info_header;
+        bmp.bmp_color_header = to.color_header;
+        bmp.palette = to.palette;
+        bmp.top_down = to.top_down;
+        bmp.pixel_format = to.format;
+        bmp.row_stride = to.row_stride;
+        if (!same_layout) {
+            bmp.data.assign((size_t) to.row_stride * to.rows, 0);
+            bmp.data.shrink_to_fit();
+        }
+
+        for_each_tile(to, Rect{ 0, 0, (uint32_t) to.info_header.width, to.rows }, [&](uint32_t index, uint32_t y, uint32_t rows, uint32_t offset, uint32_t bytes) {
+            if (same_layout && to.tiles[index] == from.tiles[index]) {
+                return;
+            }
+            uint8_t *dst = bmp.data.data() + (size_t) to.row_stride * y + offset;
+            for (uint32_t row = 0; row < rows; ++row) {
+                std::memcpy(dst + (size_t) to.row_stride * row, to.tiles[index]->data() + (size_t) bytes * row, bytes);
+            }
+        });
+        current = target;
+    }
+};
+
+#endif // EDIT_HISTORY_HEADER
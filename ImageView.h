@@ -0,0 +1,65 @@
+#ifndef IMAGE_VIEW_HEADER
+#define IMAGE_VIEW_HEADER
+
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+enum class PixelFormat : uint8_t {
+    Gray8,      // One luma byte per pixel
+    Indexed8,   // One palette index per pixel, colors live in BMP::palette
+    BGR24,
+    BGRA32
+};
+
+inline uint32_t format_channels(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::BGR24:
+            return 3;
+        case PixelFormat::BGRA32:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+// Whether the (x0, y0, w, h) region lies inside a width x height image, without the overflow of x0 + w
+inline bool region_fits(uint32_t x0, uint32_t y0, uint32_t w, uint32_t h, uint32_t width, uint32_t height) {
+    return x0 <= width && w <= width - x0 && y0 <= height && h <= height - y0;
+}
+
+// Non-owning window over pixel rows. Row y starts at ptr + y * stride,
+// so a sub-rectangle of an image is just another view over the same memory.
+// Row 0 is the bottom row; top-down images get a negative stride.
+struct ImageView {
+    uint8_t     *ptr{nullptr};
+    uint32_t    width{0};
+    uint32_t    height{0};
+    ptrdiff_t   stride{0};
+    PixelFormat format{PixelFormat::BGR24};
+
+    uint32_t channels() const {
+        return format_channels(format);
+    }
+
+    uint32_t row_bytes() const {
+        return width * channels();
+    }
+
+    uint8_t *row(uint32_t y) const {
+        return ptr + stride * (ptrdiff_t) y;
+    }
+
+    uint8_t *pixel(uint32_t x, uint32_t y) const {
+        return row(y) + channels() * x;
+    }
+
+    ImageView crop(uint32_t x0, uint32_t y0, uint32_t w, uint32_t h) const {
+        if (!region_fits(x0, y0, w, h, width, height)) {
+            throw std::runtime_error("The region does not fit in the image!");
+        }
+        return ImageView{ pixel(x0, y0), w, h, stride, format };
+    }
+};
+
+#endif // IMAGE_VIEW_HEADER
@@ -0,0 +1,24 @@
+#ifndef PARALLEL_HEADER
+#define PARALLEL_HEADER
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Calls fn(begin, end) for consecutive parts of [0, count), one part per thread
+template <typename Fn>
+void run_parallel(size_t count, unsigned threads, Fn fn) {
+    threads = std::max(1u, std::min<unsigned>(threads, count));
+    size_t part = (count + threads - 1) / threads;
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) {
+        pool.emplace_back(fn, std::min(count, part * t), std::min(count, part * (t + 1)));
+    }
+    fn(0, std::min(count, part));
+    for (std::thread &thread : pool) {
+        thread.join();
+    }
+}
+
+#endif // PARALLEL_HEADER
@@ -0,0 +1,166 @@
+#ifndef RESULT_CACHE_HEADER
+#define RESULT_CACHE_HEADER
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+// Content-addressed store of encoded output files: `<dir>/<key as 16 hex digits>.bmp`.
+// Entries are evicted least recently used first once their total size exceeds
+// the budget; the order survives restarts through the files' modification times.
+class ResultCache {
+public:
+    ResultCache(const std::string &dir, uint64_t budget_bytes) : dir(dir), budget(budget_bytes) {
+        namespace fs = boost::filesystem;
+        fs::create_directories(dir);
+
+        std::vector<std::pair<std::time_t, Entry>> found;
+        for (fs::directory_iterator it(dir), end; it != end; ++it) {
+            uint64_t key;
+            if (fs::is_regular_file(it->status()) && parse_name(it->path().filename().string(), key)) {
+                found.push_back({ fs::last_write_time(it->path()), Entry{ key, fs::file_size(it->path()) } });
+            }
+        }
+        std::sort(found.begin(), found.end(), [](const std::pair<std::time_t, Entry> &a,
+                                                 const std::pair<std::time_t, Entry> &b) {
+            return a.first > b.first;
+        });
+        for (const std::pair<std::time_t, Entry> &entry : found) {
+            add(entry.second);
+        }
+        evict();
+    }
+
+    // Fills `bytes` with the stored output of `key`; returns false on a miss
+    bool lookup(uint64_t key, std::vector<uint8_t> &bytes) {
+        auto found = entries.find(key);
+        if (found == entries.end()) {
+            ++miss_count;
+            return false;
+        }
+
+        std::ifstream inp(path_of(key), std::ios_base::binary);
+        bytes.resize(found->second->size);
+        if (!inp.read((char*) bytes.data(), bytes.size())) {
+            drop(found->second);
+            ++miss_count;
+            return false;
+        }
+
+        lru.splice(lru.begin(), lru, found->second);
+        boost::system::error_code ec;
+        boost::filesystem::last_write_time(path_of(key), std::time(nullptr), ec);
+        ++hit_count;
+        return true;
+    }
+
+    void store(uint64_t key, const std::vector<uint8_t> &bytes) {
+        auto found = entries.find(key);
+        if (found != entries.end()) {
+            drop(found->second);
+        }
+        if (bytes.size() > budget) {
+            return;
+        }
+
+        // Written aside and renamed, so a crash never leaves a truncated entry
+        std::string tmp = path_of(key) + ".tmp";
+        {
+            std::ofstream of(tmp, std::ios_base::binary);
+            if (!of.write((const char*) bytes.data(), bytes.size())) {
+                std::remove(tmp.c_str());
+                return;
+            }
+        }
+        if (std::rename(tmp.c_str(), path_of(key).c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return;
+        }
+
+        lru.push_front(Entry{ key, bytes.size() });
+        entries[key] = lru.begin();
+        total += bytes.size();
+        evict();
+    }
+
+    const std::string &directory() const {
+        return dir;
+    }
+
+    uint64_t budget_bytes() const {
+        return budget;
+    }
+
+    uint64_t size_bytes() const {
+        return total;
+    }
+
+    size_t count() const {
+        return entries.size();
+    }
+
+    uint64_t hits() const {
+        return hit_count;
+    }
+
+    uint64_t misses() const {
+        return miss_count;
+    }
+
+private:
+    struct Entry {
+        uint64_t    key;
+        uint64_t    size;
+    };
+
+    std::string                                                 dir;
+    uint64_t                                                    budget;
+    uint64_t                                                    total{0};
+    uint64_t                                                    hit_count{0};
+    uint64_t                                                    miss_count{0};
+    std::list<Entry>                                            lru;        // Most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator>    entries;
+
+    static bool parse_name(const std::string &name, uint64_t &key) {
+        if (name.size() != 20 || name.compare(16, 4, ".bmp") != 0 ||
+                name.find_first_not_of("0123456789abcdef") != 16) {
+            return false;
+        }
+        key = std::stoull(name.substr(0, 16), nullptr, 16);
+        return true;
+    }
+
+    std::string path_of(uint64_t key) const {
+        char name[21];
+        std::snprintf(name, sizeof(name), "%016llx.bmp", (unsigned long long) key);
+        return (boost::filesystem::path(dir) / name).string();
+    }
+
+    void add(const Entry &entry) {
+        lru.push_back(entry);
+        entries[entry.key] = std::prev(lru.end());
+        total += entry.size;
+    }
+
+    void drop(std::list<Entry>::iterator it) {
+        std::remove(path_of(it->key).c_str());
+        total -= it->size;
+        entries.erase(it->key);
+        lru.erase(it);
+    }
+
+    void evict() {
+        while (total > budget && !lru.empty()) {
+            drop(std::prev(lru.end()));
+        }
+    }
+};
+
+#endif // RESULT_CACHE_HEADER
@@ -0,0 +1,125 @@
+#ifndef STREAM_HASH_HEADER
+#define STREAM_HASH_HEADER
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Incremental XXH64: bytes can be fed in pieces of any size as they arrive
+// and the digest equals the one-shot XXH64 of the concatenation.
+class StreamHash {
+public:
+    explicit StreamHash(uint64_t seed = 0) : seed(seed) {
+        acc[0] = seed + P1 + P2;
+        acc[1] = seed + P2;
+        acc[2] = seed;
+        acc[3] = seed - P1;
+    }
+
+    void update(const void *bytes, size_t size) {
+        const uint8_t *p = (const uint8_t*) bytes;
+        total += size;
+
+        if (buffered + size < 32) {
+            std::memcpy(buffer + buffered, p, size);
+            buffered += size;
+            return;
+        }
+        if (buffered) {
+            size_t fill = 32 - buffered;
+            std::memcpy(buffer + buffered, p, fill);
+            stripe(buffer);
+            p += fill;
+            size -= fill;
+            buffered = 0;
+        }
+        for (; size >= 32; p += 32, size -= 32) {
+            stripe(p);
+        }
+        std::memcpy(buffer, p, size);
+        buffered = size;
+    }
+
+    void update(const std::string &text) {
+        update(text.data(), text.size());
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total >= 32) {
+            h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+            for (int i = 0; i < 4; ++i) {
+                h = (h ^ round(0, acc[i])) * P1 + P4;
+            }
+        } else {
+            h = seed + P5;
+        }
+        h += total;
+
+        const uint8_t *p = buffer;
+        size_t left = buffered;
+        for (; left >= 8; p += 8, left -= 8) {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * P1 + P4;
+        }
+        if (left >= 4) {
+            h ^= (uint64_t) read32(p) * P1;
+            h = rotl(h, 23) * P2 + P3;
+            p += 4;
+            left -= 4;
+        }
+        for (; left; ++p, --left) {
+            h ^= *p * P5;
+            h = rotl(h, 11) * P1;
+        }
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+
+private:
+    static constexpr uint64_t P1 = 11400714785074694791ULL;
+    static constexpr uint64_t P2 = 14029467366897019727ULL;
+    static constexpr uint64_t P3 = 1609587929392839161ULL;
+    static constexpr uint64_t P4 = 9650029242287828579ULL;
+    static constexpr uint64_t P5 = 2870177450012600261ULL;
+
+    uint64_t    seed;
+    uint64_t    acc[4];
+    uint64_t    total{0};
+    uint8_t     buffer[32];
+    size_t      buffered{0};
+
+    static uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64_t round(uint64_t acc, uint64_t input) {
+        acc += input * P2;
+        return rotl(acc, 31) * P1;
+    }
+
+    static uint64_t read64(const uint8_t *p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint32_t read32(const uint8_t *p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    void stripe(const uint8_t *p) {
+        for (int i = 0; i < 4; ++i) {
+            acc[i] = round(acc[i], read64(p + 8 * i));
+        }
+    }
+};
+
+#endif // STREAM_HASH_HEADER
@@ -0,0 +1,133 @@
+#ifndef VIGNETTE_MASK_HEADER
+#define VIGNETTE_MASK_HEADER
+
+#include <cmath>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "ImageView.h"
+
+// Vignette falloff cos(d / max_d * power)^4 as a fixed-point gain plane.
+// The falloff is symmetric around the center, so only one quadrant is
+// evaluated (with d^2 updated incrementally along a row) and the stored plane
+// holds the rows above the center mirrored to full width; rows below the
+// center reuse them. Masks are built once per (w, h, radius, power) and
+// shared by all threads and images through get(); the least recently used
+// masks are dropped once the cache holds more than cache_budget_bytes.
+class VignetteMask {
+public:
+    static constexpr uint32_t   gain_bits = 15;
+    static constexpr size_t     cache_budget_bytes = 128 << 20;
+
+    static std::shared_ptr<const VignetteMask> get(uint32_t width, uint32_t height, double radius, double power) {
+        static std::mutex mutex;
+        static std::list<std::shared_ptr<const VignetteMask>> masks;   // Most recently used first
+        static size_t cached_bytes = 0;
+
+        auto find = [&]() -> std::shared_ptr<const VignetteMask> {
+            for (auto it = masks.begin(); it != masks.end(); ++it) {
+                const VignetteMask &mask = **it;
+                if (mask.width == width && mask.height == height && mask.radius == radius && mask.power == power) {
+                    masks.splice(masks.begin(), masks, it);
+                    return masks.front();
+                }
+            }
+            return nullptr;
+        };
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (std::shared_ptr<const VignetteMask> mask = find()) {
+                return mask;
+            }
+        }
+
+        // Built without the lock, so other lookups are not held up; two threads may build the same mask
+        std::shared_ptr<const VignetteMask> mask = std::make_shared<const VignetteMask>(width, height, radius, power);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (std::shared_ptr<const VignetteMask> cached = find()) {
+            return cached;
+        }
+        masks.push_front(mask);
+        cached_bytes += mask->size_bytes();
+        while (cached_bytes > cache_budget_bytes) {     // A mask above the budget is only kept by the caller
+            cached_bytes -= masks.back()->size_bytes();
+            masks.pop_back();
+        }
+        return mask;
+    }
+
+    VignetteMask(uint32_t width, uint32_t height, double radius, double power)
+            : width(width), height(height), radius(radius), power(power), center_x(width >> 1), center_y(height >> 1) {
+        double max_dist = std::sqrt((double) center_x * center_x + (double) center_y * center_y) * radius;
+        double scale = max_dist > 0 ? power / max_dist : 0;
+
+        // Quadrant: gains for |x - center_x| in [0, center_x], |y - center_y| in [0, center_y]
+        uint32_t quad_w = center_x + 1;
+        std::vector<uint16_t> quadrant(quad_w);
+        gains.resize((size_t) width * (center_y + 1));
+        for (uint32_t dy = 0; dy <= center_y; ++dy) {
+            uint64_t dist2 = (uint64_t) dy * dy;
+            for (uint32_t dx = 0; dx < quad_w; ++dx) {
+                double falloff = std::cos(std::sqrt((double) dist2) * scale);
+                falloff *= falloff;
+                quadrant[dx] = (uint16_t) std::lround(falloff * falloff * (1 << gain_bits));
+                dist2 += 2 * dx + 1;
+            }
+
+            uint16_t *row = gains.data() + (size_t) width * dy;
+            for (uint32_t x = 0; x < width; ++x) {
+                row[x] = quadrant[x < center_x ? center_x - x : x - center_x];
+            }
+        }
+    }
+
+    size_t size_bytes() const {
+        return gains.size() * sizeof(uint16_t);
+    }
+
+    // pixel = pixel * gain >> gain_bits for every channel, in one pass over the rows
+    void apply(ImageView img) const {
+        if (img.width != width || img.height != height) {
+            throw std::runtime_error("The vignette mask does not fit the image!");
+        }
+        switch (img.channels()) {
+            case 1:
+                apply_rows<1>(img);
+                break;
+            case 3:
+                apply_rows<3>(img);
+                break;
+            default:
+                apply_rows<4>(img);
+                break;
+        }
+    }
+
+private:
+    uint32_t                width;
+    uint32_t                height;
+    double                  radius;
+    double                  power;
+    uint32_t                center_x;
+    uint32_t                center_y;
+    std::vector<uint16_t>   gains;      // Row dy is the gain of rows center_y +- dy
+
+    template <uint32_t channels>
+    void apply_rows(ImageView img) const {
+        for (uint32_t y = 0; y < height; ++y) {
+            const uint16_t *gain = gains.data() + (size_t) width * (y < center_y ? center_y - y : y - center_y);
+            uint8_t *pix = img.row(y);
+            for (uint32_t x = 0; x < width; ++x) {
+                for (uint32_t k = 0; k < channels; ++k) {
+                    pix[channels * x + k] = (pix[channels * x + k] * gain[x]) >> gain_bits;
+                }
+            }
+        }
+    }
+};
+
+#endif // VIGNETTE_MASK_HEADER
@@ -1,8 +1,19 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <vector>
 #include <boost/filesystem.hpp>
 #include "BMP.h"
+#include "AsyncIO.h"
+#include "BMPIndex.h"
+#include "EditHistory.h"
+#include "ResultCache.h"
+#include "StreamHash.h"
 
 
 const char hello_msg[] =
@@ -25,10 +36,31 @@ const char help_msg[] =
 "\tStandard mkdir command with flag support.\n\n"
 "`rm [-flags ...]`\n"
 "\tStandard rm command with flag support.\n\n"
-"`open [/.../path_to.bmp]`\n"
-"\tOpening .bmp file for changing and/or writing.\n\n"
-"`write [/.../path_to_save.bmp]`\n"
-"\tSaving .bmp file.\n\n"
+"`open [/.../path_to.bmp] [x0 y0 w h]`\n"
+"\tOpening .bmp file for changing and/or writing.\n"
+"\t* With ~x0, y0, w, h~ only this region is read from the file.\n\n"
+"`probe [/.../path_to.bmp]`\n"
+"\tPrinting size, bit depth and compression of .bmp file (only the headers are read).\n\n"
+"`index [/.../dir]`\n"
+"\tPrinting `probe` data of every .bmp file in the directory (current one by default).\n"
+"\t* The data is cached in `.bmpindex`, only new or changed files are probed again.\n"
+"\t* Hidden directories, like `.bmpcache`, are skipped.\n\n"
+"`prefetch [/.../path_to.bmp ...]`\n"
+"\tStarting to read .bmp files in background, so next `open` of them does not wait for the disk.\n\n"
+"`write [/.../path_to_save.bmp] [-rle / -raw]`\n"
+"\tSaving .bmp file (in background, finished before exit or next access to this file).\n"
+"\t* With `-rle` 8-bit images are saved RLE compressed (BI_RLE4 when the palette fits, BI_RLE8 otherwise),\n"
+"\t  with `-raw` uncompressed; by default the compression of the opened file is kept.\n"
+"\t* A file that fails to be written in background is reported before the next prompt.\n\n"
+"`cache on [/.../dir] [budget_MB] / off / stats`\n"
+"\tCaching results of `change`: the same file changed with the same options is taken from the cache.\n"
+"\t* By default the cache is kept in `.bmpcache` and limited to 256 MB, least recently used results are removed.\n"
+"\t* `stats` prints the number of hits and misses.\n\n"
+"`undo [name] / redo [name]`\n"
+"\tUndoing / redoing the last `change` of the opened file, or all changes back / forward to the checkpoint `name`.\n"
+"\t* Only the parts of the image a change touched are kept and restored, so history is cheap for local edits.\n\n"
+"`checkpoint [name]`\n"
+"\tNaming the current state of the opened file for `undo name` / `redo name`.\n\n"
 "`change [options]`\n"
 "\tChanging file by using flags:\n\n"
 "\t\"-negative\" / \"-n\"\n"
@@ -36,6 +68,9 @@ const char help_msg[] =
 "\t\"-replace-color\" / \"-rc\"\n"
 "\t\tReplace RGB(1) color -> RGB(2).\n"
 "\t\t* Sends a request (stdin) about getting color parameters.\n\n"
+"\t\"-replace-near\" / \"-rn\"\n"
+"\t\tReplace every color within ~tolerance~ (RGB distance) of RGB(1) -> RGB(2).\n"
+"\t\t* Sends a request (stdin) about getting color and tolerance parameters.\n\n"
 "\t\"-clarity\" / \"-cl\"\n"
 "\t\tClarity filter\n"
 "\t\t* Sends a request (stdin) about getting ~clarity force~ parameter\n\n"
@@ -43,14 +78,27 @@ const char help_msg[] =
 "\t\tGauss filter.\n\n"
 "\t\"-grey\" / \"-g\"\n"
 "\t\tGrey filter.\n\n"
+"\t\"-luma\" / \"-lg\"\n"
+"\t\tGrey filter by luma (perceived brightness).\n"
+"\t\t* Sends a request (stdin) about getting ~standard~ parameter: 601 or 709\n\n"
+"\t\"-adjust\" / \"-adj\", \"-adjust-hsv\" / \"-adj-hsv\", \"-adjust-hsl\" / \"-adj-hsl\"\n"
+"\t\tChanging saturation, hue and vibrance in one pass.\n"
+"\t\t* `-adjust` keeps the luma of every pixel, `-adjust-hsv` the value and `-adjust-hsl` the lightness.\n"
+"\t\t* Sends a request (stdin) about getting ~saturation (1 keeps), hue (degrees), vibrance [-1, 1]~ parameters\n\n"
 "\t\"-sobel\" / \"-s\"\n"
 "\t\tBorder selection filter.\n\n"
 "\t\"-median\" / \"-m\"\n"
 "\t\tMedian filter.\n"
 "\t\t* Sends a request (stdin) about getting ~median area~ parameter.\n\n"
+"\t\"-erode\" / \"-er\", \"-dilate\" / \"-di\", \"-opening\" / \"-op\", \"-closing\" / \"-cs\", \"-top-hat\" / \"-th\"\n"
+"\t\tMorphological filters with a rectangular window (the same speed for any window size).\n"
+"\t\t* Sends a request (stdin) about getting ~w, h~ window parameters\n\n"
 "\t\"-viniette\" / \"-v\"\n"
 "\t\tViniette filter.\n"
 "\t\t* Sends a request (stdin) about getting ~radius & power~ parameters\n\n"
+"\t\"-overlay\" / \"-ov\"\n"
+"\t\tDrawing another .bmp over the picture (32-bit images are blended by their alpha).\n"
+"\t\t* Sends a request (stdin) about getting ~path, x0, y0, mode (over / multiply / screen), opacity [0, 255]~ parameters\n\n"
 "\t\"-frame\" / \"-f\"\n"
 "\t\tFraming .bmp\n"
 "\t\t* Sends a request (stdin) about getting ~x0, y0, w, h~ parameters\n\n"
@@ -60,8 +108,224 @@ const char help_msg[] =
 "-----\\ BMP Redactor Helper \\-----\n"
 ;
 
+const char usage_msg[] =
+"Usage:\n"
+"\tBMP                         Interactive terminal.\n"
+"\tBMP --probe file.bmp ...    Printing size, bit depth and compression of files.\n"
+"\tBMP --index [dir]           Printing (and caching) the same data for every .bmp file in the directory.\n"
+;
+
 using namespace boost::filesystem;
 
+static const char *compression_name(uint32_t compression) {
+    switch (compression) {
+        case BI_RGB:
+            return "BI_RGB";
+        case BI_RLE8:
+            return "BI_RLE8";
+        case BI_RLE4:
+            return "BI_RLE4";
+        case BI_BITFIELDS:
+            return "BI_BITFIELDS";
+        default:
+            return "unknown";
+    }
+}
+
+static void print_info(const std::string &path, const BMPInfo &info) {
+    std::cout << path << '\t' << info.width << 'x' << info.height << '\t' << info.bit_count << " bpp\t"
+                << compression_name(info.compression) << (info.top_down ? "\ttop-down" : "") << '\n';
+}
+
+static void print_index(const std::string &dir) {
+    BMPIndex index(dir);
+    size_t probed = index.refresh();
+    for (const BMPIndexEntry &entry : index.entries()) {
+        print_info(entry.path, entry.info);
+    }
+    std::cout << index.entries().size() << " files indexed, " << probed << " probed.\n";
+}
+
+struct FilterOp {
+    std::string             name;
+    std::vector<double>     params;
+    std::vector<uint8_t>    file_bytes;     // Second image of the option, if any
+    uint64_t                file_hash{0};
+
+    explicit FilterOp(const std::string &name, std::vector<double> params = {})
+            : name(name), params(std::move(params)) {
+    }
+};
+
+// "name(p1,p2);..." with exact parameter values, the filter chain part of a cache key
+static std::string canonical_chain(const std::vector<FilterOp> &ops) {
+    std::string chain;
+    for (const FilterOp &op : ops) {
+        chain += op.name;
+        if (!op.file_bytes.empty()) {
+            char hash[20];
+            std::snprintf(hash, sizeof(hash), "[%016llx]", (unsigned long long) op.file_hash);
+            chain += hash;
+        }
+        chain += '(';
+        for (size_t i = 0; i < op.params.size(); ++i) {
+            char value[32];
+            std::snprintf(value, sizeof(value), "%s%.17g", i ? "," : "", op.params[i]);
+            chain += value;
+        }
+        chain += ");";
+    }
+    return chain;
+}
+
+static uint64_t chain_key(uint64_t state_key, const std::string &chain) {
+    StreamHash hash;
+    hash.update(&state_key, sizeof(state_key));
+    hash.update(chain);
+    return hash.digest();
+}
+
+// The image part of a cache key: the pixels and the headers that shape the written file, not the
+// bytes of the file it came from, so an image gets the same key after `open`, a cropped `open` or `undo`
+static uint64_t image_key(BMP &bmp) {
+    ImageView img = bmp.view();
+    uint32_t shape[] = { img.width, img.height, (uint32_t) img.format, bmp.top_down, 
+                         bmp.bmp_info_header.bit_count, bmp.bmp_info_header.compression };
+    StreamHash hash;
+    hash.update(shape, sizeof(shape));
+    if (bmp.bmp_info_header.bit_count == 32) {
+        hash.update(&bmp.bmp_color_header, sizeof(bmp.bmp_color_header));
+    }
+    hash.update(bmp.palette.data(), bmp.palette.size() * sizeof(uint32_t));
+    for (uint32_t y = 0; y < img.height; ++y) {
+        hash.update(img.row(y), (size_t) img.width * img.channels());
+    }
+    return hash.digest();
+}
+
+static void apply_op(BMP &bmp, const FilterOp &op) {
+    const std::vector<double> &p = op.params;
+    if (op.name == "negative") {
+        bmp.negative();
+    } else 
+    if (op.name == "replace-color") {
+        std::cout << bmp.replace_color(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8]) 
+                << " pixels have changed!\n";
+    } else 
+    if (op.name == "luma") {
+        bmp.luma_grey(p[0] == 709 ? LumaStandard::Rec709 : LumaStandard::Rec601);
+    } else 
+    if (op.name == "adjust") {
+        ColorAdjust adjust;
+        adjust.saturation = p[0];
+        adjust.hue = p[1];
+        adjust.vibrance = p[2];
+        adjust.model = (ColorModel) p[3];
+        bmp.adjust_colors(adjust);
+    } else 
+    if (op.name == "clarity") {
+        bmp.clarity(p[0]);
+    } else 
+    if (op.name == "gauss") {
+        bmp.gauss();
+    } else 
+    if (op.name == "grey") {
+        bmp.grey();
+    } else 
+    if (op.name == "sobel") {
+        bmp.sobel();
+    } else 
+    if (op.name == "median") {
+        bmp.median_filter(p[0]);
+    } else 
+    if (op.name == "erode") {
+        bmp.erode(p[0], p[1]);
+    } else 
+    if (op.name == "dilate") {
+        bmp.dilate(p[0], p[1]);
+    } else 
+    if (op.name == "opening") {
+        bmp.opening(p[0], p[1]);
+    } else 
+    if (op.name == "closing") {
+        bmp.closing(p[0], p[1]);
+    } else 
+    if (op.name == "top-hat") {
+        bmp.top_hat(p[0], p[1]);
+    } else 
+    if (op.name == "overlay") {
+        BMP layer;
+        layer.load(op.file_bytes);
+        bmp.overlay(layer, p[0], p[1], (BlendMode) p[2], p[3]);
+    } else 
+    if (op.name == "viniette") {
+        bmp.viniette(p[0], p[1]);
+    } else 
+    if (op.name == "frame") {
+        bmp.frame(p[0], p[1], p[2], p[3]);
+    } else 
+    if (op.name == "resize") {
+        bmp.resize(p[0], p[1]);
+    }
+}
+
+// The part of `bmp` the ops are going to change: overlays on a 24 or 32-bit image only
+// touch the rectangles of their layers, any other op may change every pixel or the layout
+static EditHistory::Rect changed_rect(const BMP &bmp, const std::vector<FilterOp> &ops) {
+    EditHistory::Rect all = EditHistory::whole(bmp);
+    if (bmp.format() != PixelFormat::BGR24 && bmp.format() != PixelFormat::BGRA32) {
+        return all;
+    }
+
+    int64_t left = all.width, bottom = all.height, right = 0, top = 0;
+    for (const FilterOp &op : ops) {
+        BMPInfoHeader layer;
+        if (op.name != "overlay" || op.file_bytes.size() < sizeof(BMPFileHeader) + sizeof(layer)) {
+            return all;
+        }
+        std::memcpy(&layer, op.file_bytes.data() + sizeof(BMPFileHeader), sizeof(layer));
+        int64_t x0 = (int64_t) op.params[0], y0 = (int64_t) op.params[1];
+        left = std::min(left, std::max<int64_t>(x0, 0));
+        bottom = std::min(bottom, std::max<int64_t>(y0, 0));
+        right = std::max(right, std::min<int64_t>(x0 + std::abs((int64_t) layer.width), all.width));
+        top = std::max(top, std::min<int64_t>(y0 + std::abs((int64_t) layer.height), all.height));
+    }
+    if (left >= right || bottom >= top) {
+        return EditHistory::Rect{ 0, 0, 0, 0 };
+    }
+    return EditHistory::Rect{ (uint32_t) left, (uint32_t) bottom, (uint32_t) (right - left), (uint32_t) (top - bottom) };
+}
+
+int run_command_line(int argc, char **argv) {
+    std::string mode = argv[1];
+    int status = 0;
+
+    if (mode == "--probe" && argc > 2) {
+        for (int i = 2; i < argc; ++i) {
+            try {
+                print_info(argv[i], BMP::probe(argv[i]));
+            }
+            catch (const std::exception &e) {
+                std::cerr << argv[i] << ": " << e.what() << '\n';
+                status = 1;
+            }
+        }
+    } else 
+    if (mode == "--index") {
+        try {
+            print_index(argc > 2 ? argv[2] : ".");
+        }
+        catch (const std::exception &e) {
+            std::cerr << e.what() << '\n';
+            status = 1;
+        }
+    } else {
+        std::cout << usage_msg;
+        status = 1;
+    }
+    return status;
+}
+
 void open_console() {
     bool is_need_exit = false;
     bool is_request_ok = false;
@@ -71,14 +335,28 @@ void open_console() {
     std::string other_comm;
     std::string bmp_path;
     BMP bmp;
+    AsyncIO io;
+    std::unique_ptr<ResultCache> cache;
+    EditHistory history;
+    uint64_t state_key = 0;     // image_key() of the opened image chained with the changes made since
+    bool is_state_key_set = false;
 
     std::cout << hello_msg;
     while (!is_need_exit) {
+        for (const std::string &path : io.take_failed_writes()) {
+            std::cout << "Unable to write \"" << path << "\"!\n";
+        }
         std::cout << current_path().c_str() << "$ ";
 
         std::cin >> comm;
         if (comm == "exit") {
             is_need_exit = true;
+            try {
+                io.flush();
+            }
+            catch (const std::exception &e) {
+                std::cout << e.what() << "!\n";
+            }
         } else 
         if (comm == "help") {
             std::cout << help_msg;
@@ -136,15 +414,145 @@ void open_console() {
             }
         } else 
         if (comm == "open") {
-            std::cin >> bmp_path;
-            bmp.read(bmp_path.c_str());
-            std::cout << '"' << bmp_path << "\" opened!\n";
+            uint32_t x0, y0, w, h;
+
+            std::getline(std::cin, other_comm);
+            std::istringstream open_args(other_comm);
+            open_args >> bmp_path;
+            if (open_args >> x0 >> y0 >> w >> h) {
+                bmp.read(bmp_path.c_str(), x0, y0, w, h);
+                is_state_key_set = false;
+                std::cout << '"' << bmp_path << "\" opened with (x0; y0; w; h) = (" << x0 << "; " << y0 << "; "
+                                << w << "; " << h << ")!\n";
+            } else {
+                bmp.load(io.read(bmp_path));
+                is_state_key_set = false;
+                std::cout << '"' << bmp_path << "\" opened!\n";
+            }
+            history.reset(bmp);
             is_bmp_opened = true;
         } else 
+        if (comm == "undo" || comm == "redo") {
+            std::string name;
+
+            std::getline(std::cin, other_comm);
+            std::istringstream history_args(other_comm);
+            history_args >> name;
+            if (!is_bmp_opened) {
+                std::cout << "There is no opened .bmp files. Use `open` command to open .bmp\n";
+                continue;
+            }
+            if (comm == "undo" ? history.undo(bmp, name) : history.redo(bmp, name)) {
+                is_state_key_set = false;
+                std::cout << comm << " done: " << history.undo_steps() << " undo / " << history.redo_steps()
+                            << " redo steps left, history uses " << (history.memory_bytes() >> 10) << " KB.\n";
+            } else {
+                std::cout << "Nothing to " << comm << (name.empty() ? "" : " to \"" + name + '"') << "!\n";
+            }
+        } else 
+        if (comm == "checkpoint") {
+            std::string name;
+
+            std::getline(std::cin, other_comm);
+            std::istringstream checkpoint_args(other_comm);
+            if (!is_bmp_opened) {
+                std::cout << "There is no opened .bmp files. Use `open` command to open .bmp\n";
+                continue;
+            }
+            if (!(checkpoint_args >> name)) {
+                name = '#' + std::to_string(history.undo_steps());
+            }
+            history.checkpoint(name);
+            std::cout << "Checkpoint \"" << name << "\" set!\n";
+        } else 
+        if (comm == "probe") {
+            std::cin >> other_comm;
+            try {
+                print_info(other_comm, BMP::probe(other_comm.c_str()));
+            }
+            catch(...) {
+                std::cout << "Error in probe command!\n";
+            }
+        } else 
+        if (comm == "index") {
+            std::getline(std::cin, other_comm);
+            std::istringstream index_args(other_comm);
+            std::string dir = ".";
+            index_args >> dir;
+            try {
+                print_index(dir);
+            }
+            catch(...) {
+                std::cout << "Error in index command!\n";
+            }
+        } else 
+        if (comm == "prefetch") {
+            std::getline(std::cin, other_comm);
+            std::istringstream paths(other_comm);
+            for (std::string path; paths >> path;) {
+                io.prefetch(path);
+                std::cout << '"' << path << "\" is being read...\n";
+            }
+        } else 
         if (comm == "write") {
-            std::cin >> bmp_path;
-            bmp.write(bmp_path.c_str());
-            std::cout << '"' << bmp_path << "\" wrote!\n";
+            std::vector<uint8_t> file_bytes;
+            std::string write_flag;
+
+            std::getline(std::cin, other_comm);
+            std::istringstream write_args(other_comm);
+            write_args >> bmp_path >> write_flag;
+            if (write_flag == "-rle") {
+                bmp.bmp_info_header.compression = BI_RLE4;
+            } else if (write_flag == "-raw") {
+                bmp.bmp_info_header.compression = BI_RGB;
+            }
+            bmp.encode(file_bytes);
+            try {
+                io.write_behind(bmp_path, std::move(file_bytes));
+                std::cout << '"' << bmp_path << "\" wrote!\n";
+            }
+            catch (const std::exception &e) {
+                std::cout << e.what() << "!\n";
+            }
+        } else 
+        if (comm == "cache") {
+            std::string mode;
+            std::string dir = ".bmpcache";
+            uint64_t budget_mb = 256;
+
+            std::getline(std::cin, other_comm);
+            std::istringstream cache_args(other_comm);
+            cache_args >> mode;
+            if (mode == "on") {
+                try {
+                    // `cache on [dir] [budget_MB]`: a number alone is the budget
+                    for (std::string arg; cache_args >> arg;) {
+                        if (arg.find_first_not_of("0123456789") == std::string::npos) {
+                            budget_mb = std::stoull(arg);
+                        } else {
+                            dir = arg;
+                        }
+                    }
+                    cache.reset(new ResultCache(absolute(dir).string(), budget_mb << 20));
+                    io.hash_reads(true);
+                    std::cout << "Cache is on: " << cache->count() << " results in \"" << cache->directory() << "\"!\n";
+                }
+                catch(...) {
+                    std::cout << "Error in cache command!\n";
+                }
+            } else 
+            if (mode == "off") {
+                cache.reset();
+                io.hash_reads(false);
+                std::cout << "Cache is off!\n";
+            } else 
+            if (mode == "stats" && cache) {
+                std::cout << cache->hits() << " hits, " << cache->misses() << " misses, " << cache->count() 
+                            << " results, " << (cache->size_bytes() >> 10) << " of " << (cache->budget_bytes() >> 10) 
+                            << " KB used.\n";
+            } else {
+                std::cout << "Error in cache options!\n";
+            }
         } else 
         if (comm == "change") {
             std::getline(std::cin, other_comm);
@@ -156,22 +564,78 @@ void open_console() {
             }
 
             std::istringstream to_split(other_comm);
+            std::vector<FilterOp> ops;
 
             for (std::string optn; to_split >> optn && !optn.empty();) {
                 if (optn == "-negative" || optn == "-n") {
                     std::cout << "Setting negative to \"" << bmp_path << "\"...\n";
-                    bmp.negative();
+                    ops.push_back(FilterOp("negative"));
                 } else 
-                if (optn == "-replace-color" || optn == "-rc") {
-                    uint32_t R1, G1, B1, A1, R2, G2, B2, A2 = 1;
+                if (optn == "-replace-color" || optn == "-rc" || optn == "-replace-near" || optn == "-rn") {
+                    uint32_t R1, G1, B1, A1 = 255, R2, G2, B2, A2 = 1, tolerance = 0;
+                    bool is_near = optn == "-replace-near" || optn == "-rn";
 
                     is_request_ok = false;
                     while (!is_request_ok) {
-                        std::cout << "Please, enter (R1, G1, B1)->(R2, G2, B2) colors in range [0, 255] splitted by space to replace color in \"" 
+                        std::cout << "Please, enter (R1, G1, B1)->(R2, G2, B2) colors in range [0, 255] " 
+                                        << (is_near ? "and ~tolerance~ " : "") << "splitted by space to replace color in \"" 
                                         << bmp_path << "\"...\n";
                         std::cin >> R1 >> G1 >> B1 >> R2 >> G2 >> B2;
+                        if (is_near) {
+                            std::cin >> tolerance;
+                        }
                         std::cout << "Replacing color (" << R1 << "; " << G1 << "; " << B1 << ")->(" 
-                                    << R2 << "; " << G2 << "; " << B2 << ") in \"" << bmp_path << "\"...\n";
+                                    << R2 << "; " << G2 << "; " << B2 << ") with tolerance = " << tolerance 
+                                    << " in \"" << bmp_path << "\"...\n";
+                        
+                        std::cout << "\nAre you sure? (y/n): ";
+                        std::cin >> request_conf;
+                        if (request_conf == "y") {
+                            is_request_ok = true;
+                        }
+                    }
+
+                    ops.push_back(FilterOp("replace-color", { (double) R1, (double) G1, (double) B1, (double) A1, 
+                                                              (double) R2, (double) G2, (double) B2, (double) A2, 
+                                                              (double) tolerance }));
+                } else 
+                if (optn == "-luma" || optn == "-lg") {
+                    int standard = 601;
+
+                    is_request_ok = false;
+                    while (!is_request_ok) {
+                        std::cout << "Please, enter ~standard~ (601 or 709) to set luma grey filter in \"" 
+                                        << bmp_path << "\"...\n";
+                        std::cin >> standard;
+                        std::cout << "Setting luma grey filter with Rec." << (standard == 709 ? 709 : 601) 
+                                        << " in \"" << bmp_path << "\"...\n";
+                        
+                        std::cout << "\nAre you sure? (y/n): ";
+                        std::cin >> request_conf;
+                        if (request_conf == "y") {
+                            is_request_ok = true;
+                        }
+                    }
+
+                    ops.push_back(FilterOp("luma", { standard == 709 ? 709.0 : 601.0 }));
+                } else 
+                if (optn == "-adjust" || optn == "-adj" || optn == "-adjust-hsv" || optn == "-adj-hsv" || 
+                        optn == "-adjust-hsl" || optn == "-adj-hsl") {
+                    double saturation = 1.0, hue = 0.0, vibrance = 0.0;
+                    ColorModel model = ColorModel::YCbCr;
+                    if (optn == "-adjust-hsv" || optn == "-adj-hsv") {
+                        model = ColorModel::HSV;
+                    } else if (optn == "-adjust-hsl" || optn == "-adj-hsl") {
+                        model = ColorModel::HSL;
+                    }
+
+                    is_request_ok = false;
+                    while (!is_request_ok) {
+                        std::cout << "Please, enter ~saturation, hue, vibrance~ (double) to adjust colors in \"" 
+                                        << bmp_path << "\"...\n";
+                        std::cin >> saturation >> hue >> vibrance;
+                        std::cout << "Adjusting colors with (saturation; hue; vibrance) = (" << saturation << "; " 
+                                        << hue << "; " << vibrance << ") in \"" << bmp_path << "\"...\n";
                         
                         std::cout << "\nAre you sure? (y/n): ";
                         std::cin >> request_conf;
@@ -180,8 +644,7 @@ void open_console() {
                         }
                     }
 
-                    std::cout << bmp.replace_color(R1, G1, B1, A1, R2, G2, B2, A2) 
-                            << " pixels have changed!\n";
+                    ops.push_back(FilterOp("adjust", { saturation, hue, vibrance, (double) model }));
                 } else 
                 if (optn == "-clarity" || optn == "-cl") {
                     double clarity_force = 8;
@@ -202,25 +665,24 @@ void open_console() {
                     }
 
                     if (clarity_force == 0.0) {
-                        bmp.clarity();
-                    } else {
-                        bmp.clarity(clarity_force);
+                        clarity_force = 8;
                     }
+                    ops.push_back(FilterOp("clarity", { clarity_force }));
                 } else 
                 if (optn == "-gauss") {
                     std::cout << "Setting gauss filter in \"" 
                                     << bmp_path << "\"...\n";
-                    bmp.gauss();
+                    ops.push_back(FilterOp("gauss"));
                 } else 
                 if (optn == "-grey" || optn == "-g") {
                     std::cout << "Setting grey filter in \"" 
                                         << bmp_path << "\"...\n";
-                    bmp.grey();
+                    ops.push_back(FilterOp("grey"));
                 } else 
                 if (optn == "-sobel" || optn == "-s") {
                     std::cout << "Setting border selection filter in \"" 
                                         << bmp_path << "\"...\n";
-                    bmp.sobel();
+                    ops.push_back(FilterOp("sobel"));
                 } else 
                 if (optn == "-median" || optn == "-m") {
                     int median_area = 1;
@@ -240,10 +702,38 @@ void open_console() {
                         }
                     }
                     if (median_area == 0) {
-                        bmp.median_filter();
-                    } else {
-                        bmp.median_filter(median_area);
+                        median_area = 1;
                     }
+                    ops.push_back(FilterOp("median", { (double) median_area }));
+                } else 
+                if (optn == "-erode" || optn == "-er" || optn == "-dilate" || optn == "-di" || optn == "-opening" || 
+                        optn == "-op" || optn == "-closing" || optn == "-cs" || optn == "-top-hat" || optn == "-th") {
+                    const char *names[][2] = {{ "-er", "erode" }, { "-di", "dilate" }, { "-op", "opening" }, 
+                                              { "-cs", "closing" }, { "-th", "top-hat" }};
+                    std::string name;
+                    for (auto &alias : names) {
+                        if (optn == alias[0] || optn == std::string("-") + alias[1]) {
+                            name = alias[1];
+                        }
+                    }
+                    uint32_t window_w = 3, window_h = 3;
+
+                    is_request_ok = false;
+                    while (!is_request_ok) {
+                        std::cout << "Please, enter ~w, h~ (uint) of the window to set " << name << " filter in \"" 
+                                        << bmp_path << "\"...\n";
+                        std::cin >> window_w >> window_h;
+                        std::cout << "Setting " << name << " filter with (w; h) = (" << window_w << "; " 
+                                        << window_h << ") in \"" << bmp_path << "\"...\n";
+                        
+                        std::cout << "\nAre you sure? (y/n): ";
+                        std::cin >> request_conf;
+                        if (request_conf == "y") {
+                            is_request_ok = true;
+                        }
+                    }
+
+                    ops.push_back(FilterOp(name, { (double) std::max(window_w, 1u), (double) std::max(window_h, 1u) }));
                 } else 
                 if (optn == "-viniette" || optn == "-v") {
                     double radius = 1.0, power = 0.8;
@@ -263,7 +753,40 @@ void open_console() {
                         }
                     }
 
-                    bmp.viniette(radius, power);
+                    ops.push_back(FilterOp("viniette", { radius, power }));
+                } else 
+                if (optn == "-overlay" || optn == "-ov") {
+                    std::string layer_path, mode_name;
+                    int32_t x0 = 0, y0 = 0;
+                    uint32_t opacity = 255;
+                    BlendMode mode = BlendMode::Over;
+
+                    is_request_ok = false;
+                    while (!is_request_ok) {
+                        std::cout << "Please, enter ~path, x0, y0, mode (over / multiply / screen), opacity~ to overlay \"" 
+                                        << bmp_path << "\"...\n";
+                        std::cin >> layer_path >> x0 >> y0 >> mode_name >> opacity;
+                        mode = mode_name == "multiply" ? BlendMode::Multiply : 
+                                (mode_name == "screen" ? BlendMode::Screen : BlendMode::Over);
+                        std::cout << "Drawing \"" << layer_path << "\" at (x0; y0) = (" << x0 << "; " << y0 << ") with " 
+                                        << mode_name << " mode and opacity = " << opacity << " in \"" << bmp_path << "\"...\n";
+                        
+                        std::cout << "\nAre you sure? (y/n): ";
+                        std::cin >> request_conf;
+                        if (request_conf == "y") {
+                            is_request_ok = true;
+                        }
+                    }
+
+                    FilterOp op("overlay", { (double) x0, (double) y0, (double) mode, (double) std::min(opacity, 255u) });
+                    try {
+                        op.file_bytes = io.read(layer_path, &op.file_hash);
+                    }
+                    catch (const std::exception &e) {
+                        std::cout << e.what() << "!\n";
+                        continue;
+                    }
+                    ops.push_back(std::move(op));
                 } else 
                 if (optn == "-frame" || optn == "-f") {
                     uint32_t x0, y0, w, h;
@@ -283,7 +806,7 @@ void open_console() {
                         }
                     }
 
-                    bmp.frame(x0, y0, w, h);
+                    ops.push_back(FilterOp("frame", { (double) x0, (double) y0, (double) w, (double) h }));
                 } else 
                 if (optn == "-resize" || optn == "-rs") {
                     uint32_t new_width, new_height;
@@ -303,7 +826,7 @@ void open_console() {
                         }
                     }
 
-                    bmp.resize(new_width, new_height);
+                    ops.push_back(FilterOp("resize", { (double) new_width, (double) new_height }));
                 }
                 else {
                     std::cout << "Wrong option: `" << optn << "`!\n";
@@ -311,6 +834,39 @@ void open_console() {
                     continue;
                 }
             }
+
+            if (ops.empty()) {
+                continue;
+            }
+            EditHistory::Rect rect = changed_rect(bmp, ops);
+            history.prepare(bmp, rect);
+            if (!cache) {
+                for (const FilterOp &op : ops) {
+                    apply_op(bmp, op);
+                }
+                history.commit(bmp, rect);
+                is_state_key_set = false;
+                continue;
+            }
+
+            if (!is_state_key_set) {
+                state_key = image_key(bmp);
+            }
+            uint64_t key = chain_key(state_key, canonical_chain(ops));
+            std::vector<uint8_t> file_bytes;
+            if (cache->lookup(key, file_bytes)) {
+                bmp.load(file_bytes);
+                std::cout << "Result is taken from the cache!\n";
+            } else {
+                for (const FilterOp &op : ops) {
+                    apply_op(bmp, op);
+                }
+                bmp.encode(file_bytes);
+                cache->store(key, file_bytes);
+            }
+            history.commit(bmp, rect);
+            state_key = key;
+            is_state_key_set = true;
         }
     }
 }
@@ -2,8 +2,12 @@
 #include "BMP.h"
 
 void open_console();
+int run_command_line(int argc, char **argv);
 
-int main() {
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        return run_command_line(argc, argv);
+    }
 
     open_console();
 